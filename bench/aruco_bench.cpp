@@ -0,0 +1,367 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "aruco.hpp"
+#include "detector.hpp"
+#include "threshold.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+
+// Solver of the reference pose. SOLVEPNP_IPPE_SQUARE is made for
+// squares, but only exists since OpenCV 3.4.6 and 4.1
+#if (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR == 4 && CV_VERSION_REVISION >= 6) \
+        || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 1) || CV_VERSION_MAJOR > 4
+#define MARKER_PNP_METHOD SOLVEPNP_IPPE_SQUARE
+#else
+#define MARKER_PNP_METHOD SOLVEPNP_ITERATIVE
+#endif
+
+// Time taken by the runs of a stage, in milliseconds
+struct StageTime {
+        string stage;
+        double mean;
+        double min;
+        double max;
+};
+
+// Results of the stages for a frame of a given size and number of markers
+struct BenchRun {
+        Size resolution;
+        int markers;
+        int detected;
+        RejectCounters rejects;
+        vector<StageTime> stages;
+};
+
+StageTime time_stage(const string &stage, int iterations, function<void()> setup, function<void()> run);
+Mat marker_image(int id, int side);
+Mat build_frame(const Mat &background, const vector<Mat> &markers, Size resolution, int count);
+void solve_pnp_pose(Aruco &aruco, const Camera &camera);
+BenchRun bench_frame(const Mat &frame, int count, int iterations, const Camera &camera, const DecodingTable &decoding_table);
+void write_json(ostream &os, int iterations, const vector<BenchRun> &runs);
+
+// Benchmark of each stage of the detection on its own
+//
+// The frames are a calibration image with a grid of the first markers
+// of the dictionary pasted on it, for several resolutions and numbers
+// of markers. The stages run on the same frame over and over, and the
+// mean, min and max time of each one is written as JSON
+int main(int argc, char **argv) {
+
+        const String keys =
+        "{help h usage ? |                 | Print this message }"
+        "{c              |                 | Camera calibration file (calibration.txt by default) }"
+        "{out            |aruco_bench.json | Output JSON file }"
+        "{iterations     |20               | Number of runs of each stage }";
+
+        CommandLineParser cmdParser(argc, argv, keys);
+
+        if (cmdParser.has("help"))
+        {
+                cmdParser.printMessage();
+                return 0;
+        }
+
+        const string source_dir(ARUCO_SOURCE_DIR);
+        int iterations = max(1, cmdParser.get<int>("iterations"));
+
+        String calibration_file = cmdParser.get<String>("c");
+        if (calibration_file == "")
+                calibration_file = source_dir + "/calibration.txt";
+
+        // The calibration is for 1280x720 frames and scaled to the others
+        Camera calibrated;
+        calibrated.marker_size = 1;
+        calibrate_camera(calibration_file, calibrated.camMatrix, calibrated.distCoeffs);
+
+        Mat background = imread(source_dir + "/util/calibration/calib_images/mpv-shot0001.jpg", IMREAD_COLOR);
+        if (background.empty()) {
+                cerr << "Cannot read the calibration image, using a gray background" << endl;
+                background = Mat(720, 1280, CV_8UC3, Scalar::all(128));
+        }
+
+        vector<Mat> markers;
+        for(int id = 0; id < min(16, DICT_NUM_MARKERS); ++id) {
+                markers.push_back(marker_image(id, 60 * MARKER_CELLS));
+        }
+
+        DecodingTable decoding_table;
+        build_decoding_table(decoding_table, 1);
+
+        const Size resolutions[] = {
+                Size(640, 480), Size(1280, 720), Size(1920, 1080)
+        };
+        const int marker_counts[] = {1, 4, 16};
+
+        vector<BenchRun> runs;
+
+        for(auto &res : resolutions) {
+                Camera camera = calibrated;
+                camera.camMatrix = calibrated.camMatrix.clone();
+                camera.camMatrix.at<double>(0, 0) *= res.width / 1280.0;
+                camera.camMatrix.at<double>(0, 2) *= res.width / 1280.0;
+                camera.camMatrix.at<double>(1, 1) *= res.height / 720.0;
+                camera.camMatrix.at<double>(1, 2) *= res.height / 720.0;
+
+                for(int count : marker_counts) {
+                        Mat frame = build_frame(background, markers, res, count);
+                        BenchRun run = bench_frame(frame, count, iterations, camera, decoding_table);
+                        runs.push_back(run);
+
+                        cout << res.width << "x" << res.height << "  markers: " << count
+                             << "  detected: " << run.detected << endl;
+                        for(auto &stage : run.stages) {
+                                cout << "  " << stage.stage << ": " << stage.mean << " ms" << endl;
+                        }
+                        print_reject_counters(cout, run.rejects);
+                }
+        }
+
+        String out_file = cmdParser.get<String>("out");
+        ofstream out(out_file);
+        if (!out.is_open()) {
+                cerr << "Cannot open \"" + out_file + "\"" << endl;
+                return -1;
+        }
+        write_json(out, iterations, runs);
+        cout << "Results written to: " << out_file << endl;
+}
+
+// Run a stage several times and return how long it took
+//
+// setup runs before every run of the stage and is not timed
+StageTime time_stage(const string &stage, int iterations, function<void()> setup, function<void()> run) {
+        StageTime t = {stage, 0, 0, 0};
+
+        for(int i = 0; i < iterations; ++i) {
+                setup();
+
+                high_resolution_clock::time_point start_t = high_resolution_clock::now();
+                run();
+                duration<double, std::milli> elapsed = high_resolution_clock::now() - start_t;
+
+                t.mean += elapsed.count();
+                t.min = i == 0 ? elapsed.count() : min(t.min, elapsed.count());
+                t.max = max(t.max, elapsed.count());
+        }
+        t.mean /= iterations;
+        return t;
+}
+
+// Gray image of a marker of the dictionary, side x side pixels
+Mat marker_image(int id, int side) {
+        Mat cells(MARKER_CELLS, MARKER_CELLS, CV_8UC1, Scalar::all(0));
+
+        for(int c = 0; c < DICT_MARKER_BITS; ++c) {
+                for(int r = 0; r < DICT_MARKER_BITS; ++r) {
+                        if ((DICT_CODES[id] >> (c * DICT_MARKER_BITS + r)) & 1)
+                                cells.at<uint8_t>(c + 1, r + 1) = 255;
+                }
+        }
+
+        Mat marker;
+        resize(cells, marker, Size(side, side), 0, 0, INTER_NEAREST);
+        return marker;
+}
+
+// Paste count markers on the background, in a grid over the frame
+//
+// Each marker sits on a white square, as if printed on paper, and is
+// turned a quarter more than the previous one. The ids repeat when
+// there are more markers than images
+Mat build_frame(const Mat &background, const vector<Mat> &markers, Size resolution, int count) {
+        Mat frame;
+        resize(background, frame, resolution);
+
+        int cols = int(ceil(sqrt(double(count))));
+        int rows = (count + cols - 1) / cols;
+        int cell = min(resolution.width / cols, resolution.height / rows);
+        int paper = cell * 4 / 5;
+        int side = paper * 3 / 4;
+
+        for(int m = 0; m < count; ++m) {
+                int x = (m % cols) * cell + (cell - paper) / 2;
+                int y = (m / cols) * cell + (cell - paper) / 2;
+
+                Mat gray, bgr;
+                resize(markers[m % markers.size()], gray, Size(side, side), 0, 0, INTER_AREA);
+                for(int r = 0; r < m % 4; ++r) {
+                        transpose(gray, gray);
+                        flip(gray, gray, 1);
+                }
+                cvtColor(gray, bgr, CV_GRAY2BGR);
+
+                frame(Rect(x, y, paper, paper)).setTo(Scalar::all(255));
+                bgr.copyTo(frame(Rect(x + (paper - side) / 2, y + (paper - side) / 2, side, side)));
+        }
+        return frame;
+}
+
+// Time every stage of the detection on a frame
+//
+// Each stage takes the output of the previous one, computed once
+// before it is timed
+BenchRun bench_frame(const Mat &frame, int count, int iterations, const Camera &camera, const DecodingTable &decoding_table) {
+        BenchRun run;
+        run.resolution = frame.size();
+        run.markers = count;
+
+        auto nothing = [] {};
+
+        Mat gray(frame.size(), CV_8UC1), bw(frame.size(), CV_8UC1), work;
+        ThresholdScratch threshold_scratch;
+        ContourScratch contour_scratch;
+
+        run.stages.push_back(time_stage("gray", iterations, nothing, [&] {
+                bgr_to_gray(frame.data, frame.step, gray.data, gray.step, frame.cols, frame.rows);
+        }));
+
+        run.stages.push_back(time_stage("threshold", iterations, nothing, [&] {
+                adaptive_threshold<THRESH_BLOCK_SIZE, THRESH_C>(gray.data, gray.step, bw.data, bw.step,
+                        gray.cols, gray.rows, threshold_scratch);
+        }));
+
+        run.stages.push_back(time_stage("gray_threshold", iterations, nothing, [&] {
+                gray_adaptive_threshold<THRESH_BLOCK_SIZE, THRESH_C>(frame.data, frame.step,
+                        gray.data, gray.step, bw.data, bw.step, frame.cols, frame.rows, threshold_scratch);
+        }));
+
+        // findContours modifies its input
+        vector<Aruco> candidates;
+        run.stages.push_back(time_stage("detect_arucos", iterations,
+                [&] { bw.copyTo(work); candidates.clear(); },
+                [&] { detect_arucos(work, candidates, contour_scratch); }));
+
+        vector<Aruco> unique;
+        run.stages.push_back(time_stage("suppress_duplicates", iterations,
+                [&] { unique = candidates; },
+                [&] { suppress_duplicates(unique, contour_scratch); }));
+        candidates.swap(unique);
+
+        // Contours removed by each check of the filter, for a single frame
+        {
+                ContourScratch counting;
+                vector<Aruco> counted;
+                bw.copyTo(work);
+                detect_arucos(work, counted, counting);
+                suppress_duplicates(counted, counting);
+                run.rejects = counting.counters;
+        }
+
+        run.stages.push_back(time_stage("homography", iterations, nothing, [&] {
+                Matx33d h;
+                for(auto &candidate : candidates) cell_homography(candidate.vertex, MARKER_CELLS, h);
+        }));
+
+        vector<uint64_t> codes(candidates.size());
+        vector<bool> readable(candidates.size());
+        run.stages.push_back(time_stage("read_marker", iterations, nothing, [&] {
+                for(size_t c = 0; c < candidates.size(); ++c) {
+                        uint64_t code;
+                        readable[c] = read_marker_code(gray, candidates[c], DICT_MARKER_BITS, code);
+                        codes[c] = code;
+                }
+        }));
+
+        vector<Aruco> arucos;
+        run.stages.push_back(time_stage("lookup", iterations, [&] { arucos.clear(); }, [&] {
+                for(size_t c = 0; c < candidates.size(); ++c) {
+                        if (!readable[c]) continue;
+
+                        MarkerCode code = lookup_marker(decoding_table, codes[c]);
+                        if (code.id == -1) continue;
+
+                        arucos.push_back(candidates[c]);
+                        arucos.back().id = code.id;
+                        arucos.back().rotation = code.rotation;
+                        arucos.back().distance = code.distance;
+                }
+        }));
+        run.detected = arucos.size();
+
+        // Every marker of the frame in closed form, both poses each
+        PoseScratch pose_scratch;
+        run.stages.push_back(time_stage("pose", iterations, nothing, [&] {
+                estimate_poses(arucos, camera, nullptr, pose_scratch);
+        }));
+
+        // Same markers as in the previous frame, the pose closest to their track is kept
+        Tracker tracker;
+        update_tracks(tracker, arucos);
+        run.stages.push_back(time_stage("pose_tracked", iterations, nothing, [&] {
+                estimate_poses(arucos, camera, &tracker, pose_scratch);
+        }));
+
+        // solvePnP on each marker, the reference for the closed form solution
+        run.stages.push_back(time_stage("pose_pnp", iterations, nothing, [&] {
+                for(auto &aruco : arucos) solve_pnp_pose(aruco, camera);
+        }));
+
+        DrawScratch draw_scratch;
+        run.stages.push_back(time_stage("draw_arucos", iterations,
+                [&] { frame.copyTo(work); },
+                [&] { draw_arucos(work, arucos, Shape::Cube, camera, draw_scratch); }));
+
+        return run;
+}
+
+// Compute the first pose of a marker with solvePnP, from scratch
+//
+// Reference for the closed form solution of estimate_poses
+void solve_pnp_pose(Aruco &aruco, const Camera &camera) {
+        // Top left, top right, bottom right and bottom left, the order of marker_model_corners
+        const float half = float(camera.marker_size / 2);
+        array<Point3f, 4> model = {{
+                Point3f(-half, half, 0), Point3f(half, half, 0), Point3f(half, -half, 0), Point3f(-half, -half, 0)
+        }};
+
+        array<Point2f, 4> image_points;
+        marker_model_corners(aruco, image_points);
+
+        Mat object_mat(4, 1, CV_32FC3, model.data());
+        Mat image_mat(4, 1, CV_32FC2, image_points.data());
+        solvePnP(object_mat, image_mat, camera.camMatrix, camera.distCoeffs, aruco.rvec, aruco.tvec, false, MARKER_PNP_METHOD);
+}
+
+// Write the results as a JSON object
+//
+// {"iterations": 20, "runs": [{"width": 640, "height": 480, "markers": 4, "detected": 4,
+//   "stages": {"gray": {"mean_ms": 0.1, "min_ms": 0.1, "max_ms": 0.2}, ...}}, ...]}
+void write_json(ostream &os, int iterations, const vector<BenchRun> &runs) {
+        os << "{\"iterations\": " << iterations << ", \"runs\": [";
+
+        for(size_t r = 0; r < runs.size(); ++r) {
+                const BenchRun &run = runs[r];
+
+                os << (r ? ", " : "") << "\n  {\"width\": " << run.resolution.width
+                   << ", \"height\": " << run.resolution.height
+                   << ", \"markers\": " << run.markers
+                   << ", \"detected\": " << run.detected << ", \"stages\": {";
+
+                for(size_t s = 0; s < run.stages.size(); ++s) {
+                        const StageTime &t = run.stages[s];
+                        os << (s ? ", " : "") << "\"" << t.stage << "\": {\"mean_ms\": " << t.mean
+                           << ", \"min_ms\": " << t.min << ", \"max_ms\": " << t.max << "}";
+                }
+                os << "}, \"contours\": " << run.rejects.contours
+                   << ", \"candidates\": " << run.rejects.candidates
+                   << ", \"duplicates\": " << run.rejects.duplicates << ", \"rejected\": {";
+                for(int s = 0; s < REJECT_STAGES; ++s) {
+                        os << (s ? ", " : "") << "\"" << reject_stage_name(s) << "\": " << run.rejects.rejected[s];
+                }
+                os << "}}";
+        }
+        os << "\n]}\n";
+}
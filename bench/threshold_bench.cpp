@@ -0,0 +1,87 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "threshold.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+
+// Benchmark of the fused gray and threshold kernel against the two
+// OpenCV calls it replaces
+//
+// The input image is scaled to the usual camera resolutions. For each
+// of them the average time of both versions and the number of pixels
+// where their outputs differ are printed
+int main(int argc, char **argv) {
+
+        const String keys =
+        "{help h usage ? |   | Print this message }"
+        "{image          |   | Input image (a calibration image by default) }"
+        "{iterations     |50 | Number of runs per resolution }";
+
+        CommandLineParser cmdParser(argc, argv, keys);
+
+        if (cmdParser.has("help"))
+        {
+                cmdParser.printMessage();
+                return 0;
+        }
+
+        String image_file = cmdParser.get<String>("image");
+        if (image_file == "")
+                image_file = String(ARUCO_SOURCE_DIR) + "/util/calibration/calib_images/mpv-shot0001.jpg";
+
+        int iterations = max(1, cmdParser.get<int>("iterations"));
+
+        Mat source = imread(image_file, IMREAD_COLOR);
+        if (source.empty()) {
+                cerr << "Cannot read \"" + image_file + "\", using random noise" << endl;
+                source.create(480, 640, CV_8UC3);
+                randu(source, Scalar::all(0), Scalar::all(256));
+        }
+
+        const Size resolutions[] = {
+                Size(640, 480), Size(1280, 720), Size(1920, 1080), Size(3840, 2160)
+        };
+
+        ThresholdScratch scratch;
+
+        for(auto &res : resolutions) {
+                Mat bgr, gray_ref, bw_ref;
+                resize(source, bgr, res);
+
+                Mat gray(res, CV_8UC1), bw(res, CV_8UC1);
+
+                high_resolution_clock::time_point start_t = high_resolution_clock::now();
+                for(int i = 0; i < iterations; ++i) {
+                        cvtColor(bgr, gray_ref, CV_BGR2GRAY);
+                        adaptiveThreshold(gray_ref, bw_ref, 255,
+                                ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, THRESH_BLOCK_SIZE, THRESH_C);
+                }
+                duration<double, std::milli> baseline_t = high_resolution_clock::now() - start_t;
+
+                start_t = high_resolution_clock::now();
+                for(int i = 0; i < iterations; ++i) {
+                        gray_adaptive_threshold<THRESH_BLOCK_SIZE, THRESH_C>(
+                                bgr.data, bgr.step, gray.data, gray.step, bw.data, bw.step,
+                                bgr.cols, bgr.rows, scratch);
+                }
+                duration<double, std::milli> fused_t = high_resolution_clock::now() - start_t;
+
+                Mat diff_gray = gray != gray_ref;
+                Mat diff_bw = bw != bw_ref;
+
+                cout << res.width << "x" << res.height
+                     << "  baseline: " << baseline_t.count() / iterations << " ms"
+                     << "  fused: " << fused_t.count() / iterations << " ms"
+                     << "  speedup: " << baseline_t.count() / fused_t.count() << "x"
+                     << "  gray mismatches: " << countNonZero(diff_gray)
+                     << "  bw mismatches: " << countNonZero(diff_bw) << endl;
+        }
+}
@@ -0,0 +1,78 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <opencv2/core.hpp>
+
+#include "alloc_counter.hpp"
+
+static std::atomic<uint64_t> allocations(0);
+// Set while the Mat allocator runs, whose own use of operator new is
+// part of the Mat it already counted
+static thread_local bool in_mat_allocator = false;
+
+uint64_t allocation_count() {
+        return allocations.load(std::memory_order_relaxed);
+}
+
+// Allocator of the Mat data that counts the buffers it allocates
+//
+// The buffers come from the standard allocator of OpenCV, which then
+// frees them. Each Mat counts once, and Mats over data of the caller
+// are not counted
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+        cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                int flags, cv::UMatUsageFlags usageFlags) const override {
+                if (data == nullptr)
+                        allocations.fetch_add(1, std::memory_order_relaxed);
+
+                in_mat_allocator = true;
+                cv::UMatData *u = nullptr;
+                try {
+                        u = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+                } catch(...) {
+                        in_mat_allocator = false;
+                        throw;
+                }
+                in_mat_allocator = false;
+                return u;
+        }
+
+        bool allocate(cv::UMatData *data, int accessflags, cv::UMatUsageFlags usageFlags) const override {
+                return cv::Mat::getStdAllocator()->allocate(data, accessflags, usageFlags);
+        }
+
+        void deallocate(cv::UMatData *data) const override {
+                cv::Mat::getStdAllocator()->deallocate(data);
+        }
+};
+
+// Count the data of the Mats allocated from now on
+//
+// Must be called before any thread allocates Mats
+void count_mat_allocations() {
+        static CountingMatAllocator allocator;
+        cv::Mat::setDefaultAllocator(&allocator);
+}
+
+// The array and nothrow forms of new and delete call these ones,
+// so every allocation of the program is counted once
+void *operator new(std::size_t size) {
+        if (!in_mat_allocator)
+                allocations.fetch_add(1, std::memory_order_relaxed);
+        if (size == 0) size = 1;
+
+        while (true) {
+                void *p = std::malloc(size);
+                if (p) return p;
+
+                std::new_handler handler = std::get_new_handler();
+                if (!handler) throw std::bad_alloc();
+                handler();
+        }
+}
+
+void operator delete(void *p) noexcept {
+        std::free(p);
+}
@@ -0,0 +1,16 @@
+#ifndef _ALLOC_COUNTER_H
+#define _ALLOC_COUNTER_H
+
+#include <cstdint>
+
+// Number of heap allocations since the program started
+//
+// Calls to the global operator new are counted by the replacement
+// operator new of alloc_counter.cpp. Once count_mat_allocations is
+// called, the data of every Mat allocated by OpenCV or by us is counted
+// as well. Buffers OpenCV takes straight from cv::fastMalloc, such as
+// cv::String and AutoBuffer, are still not counted
+uint64_t allocation_count();
+void count_mat_allocations();
+
+#endif
@@ -0,0 +1,336 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <cstdio>
+
+#include <sys/stat.h>
+
+#include <opencv2/core/utility.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "detector.hpp"
+#include "work_pool.hpp"
+
+using namespace std::chrono;
+
+// Video of the batch
+//
+// The file is split into segments that are processed as separate jobs,
+// each one writing its detections to a part file. The last segment to
+// finish joins the parts into the detections file, so a file only has
+// detections once all of it has been processed
+struct BatchFile {
+        string input;
+        string output;
+        int segments;
+        atomic<int> segments_left;
+        atomic<bool> failed;
+};
+
+// Frames [begin, end) of a file. end is -1 for the rest of the file
+struct Segment {
+        BatchFile *file;
+        int part;
+        int64_t begin;
+        int64_t end;
+};
+
+// Buffers owned by a worker of the pool
+struct BatchWorker {
+        DetectScratch scratch;
+        Frame frame;
+};
+
+// Read-only data shared by every job
+struct BatchContext {
+        DecodingTable decoding_table;
+        Camera camera;
+        int pyramid_level;
+};
+
+bool list_videos(const string &input, vector<string> &videos);
+bool file_exists(const string &filename);
+bool seeks_exactly(VideoCapture &capture, int64_t frame);
+string part_name(const BatchFile &file, int part);
+vector<Segment> split_file(BatchFile &file, int64_t segment_frames);
+int64_t process_segment(const Segment &segment, BatchWorker &worker, const BatchContext &context);
+bool join_parts(const BatchFile &file);
+
+// Detect the markers of many video files in parallel
+//
+// The files of a directory, or listed in a text file, are split into
+// segments that run as jobs on a pool of workers, so long files also
+// use every core. Each file gets a detections file in the output
+// directory, with a JSON line per frame. Files that already have one
+// are skipped, so an interrupted batch can be started again
+int main(int argc, char **argv) {
+
+        const String keys =
+        "{help h usage ? |          | Print this message }"
+        "{input          |<none>    | Directory of videos or text file with a video per line }"
+        "{out            |.         | Directory of the detections files }"
+        "{c              |<none>    | Camera calibration file }"
+        "{jobs           |0         | Files or segments processed at the same time (0 = one per core) }"
+        "{segment        |3000      | Frames per segment of a file (0 = do not split the files) }"
+        "{tolerance      |1         | Number of wrong bits accepted when reading a marker }"
+        "{dictionary     |          | Dictionary file written by gen_dictionary (empty = the dictionary built in) }"
+        "{size           |1         | Side of the markers. The translation of the markers is given in the same units }"
+        "{pyramid        |0         | Look for markers in the frame halved this many times (0 = full resolution) }";
+
+        CommandLineParser cmdParser(argc, argv, keys);
+
+        if (cmdParser.has("help"))
+        {
+                cmdParser.printMessage();
+                return 0;
+        }
+
+        String input = cmdParser.get<String>("input");
+        vector<string> videos;
+        if (!list_videos(input, videos)) {
+                cerr << "Cannot read the videos of \"" + input + "\"" << endl;
+                return -1;
+        }
+
+        BatchContext context;
+        context.camera.marker_size = cmdParser.get<double>("size");
+        calibrate_camera(cmdParser.get<String>("c"), context.camera.camMatrix, context.camera.distCoeffs);
+        load_decoding_table(context.decoding_table, cmdParser.get<String>("dictionary"), cmdParser.get<int>("tolerance"));
+        context.pyramid_level = max(0, cmdParser.get<int>("pyramid"));
+
+        int jobs = cmdParser.get<int>("jobs");
+        if (jobs <= 0)
+                jobs = max(1u, thread::hardware_concurrency());
+        int64_t segment_frames = max(0, cmdParser.get<int>("segment"));
+        String out_dir = cmdParser.get<String>("out");
+
+        // The detections files are named after the videos, so two videos
+        // with the same name in different directories would write the same one
+        map<string, string> names;
+        for(auto &video : videos) {
+                string name = video.substr(video.find_last_of('/') + 1);
+                auto inserted = names.insert(make_pair(name, video));
+                if (!inserted.second) {
+                        cerr << "\"" + video + "\" and \"" + inserted.first->second + "\" have the same name, "
+                             << "process them in separate batches" << endl;
+                        return -1;
+                }
+        }
+
+        vector<unique_ptr<BatchFile> > files;
+        vector<Segment> segments;
+        int skipped = 0;
+
+        for(auto &video : videos) {
+                string name = video.substr(video.find_last_of('/') + 1);
+                string output = out_dir + "/" + name + ".jsonl";
+                if (file_exists(output)) {
+                        skipped++;
+                        continue;
+                }
+
+                files.emplace_back(new BatchFile());
+                BatchFile &file = *files.back();
+                file.input = video;
+                file.output = output;
+                file.failed = false;
+
+                vector<Segment> parts = split_file(file, segment_frames);
+                segments.insert(segments.end(), parts.begin(), parts.end());
+        }
+
+        cout << "Processing " << files.size() << " files in " << segments.size() << " segments with "
+             << jobs << " jobs, skipping " << skipped << " already done" << endl;
+
+        vector<BatchWorker> workers(jobs);
+        atomic<uint64_t> frames(0);
+        atomic<int> files_done(0), files_failed(0);
+        const int file_count = files.size();
+
+        high_resolution_clock::time_point start_t = high_resolution_clock::now();
+        {
+                WorkStealingPool pool(jobs);
+
+                for(auto &segment : segments) {
+                        pool.submit([&, segment](int worker) {
+                                BatchFile &file = *segment.file;
+
+                                int64_t n = process_segment(segment, workers[worker], context);
+                                if (n < 0)
+                                        file.failed = true;
+                                else
+                                        frames += n;
+
+                                if (--file.segments_left > 0) return;
+
+                                if (file.failed || !join_parts(file)) {
+                                        files_failed++;
+                                        cerr << "Failed: " << file.input << endl;
+                                } else {
+                                        cout << "Done (" << ++files_done << "/" << file_count << "): " << file.input << endl;
+                                }
+                        });
+                }
+                pool.shutdown();
+        }
+        duration<double> total_time = high_resolution_clock::now() - start_t;
+
+        cout << "Processed " << frames << " frames of " << files_done << " files in " << total_time.count() << " s ("
+             << (total_time.count() > 0 ? frames / total_time.count() : 0.0) << " fps)" << endl;
+
+        if (files_failed > 0) {
+                cerr << files_failed << " files failed" << endl;
+                return 1;
+        }
+}
+
+// Videos of a directory, or the files listed in a text file
+//
+// Return false if the input cannot be read
+bool list_videos(const string &input, vector<string> &videos) {
+        struct stat info;
+        if (stat(input.c_str(), &info) != 0) return false;
+
+        if (S_ISDIR(info.st_mode)) {
+                const char *patterns[] = {"*.avi", "*.mp4", "*.mkv", "*.mov"};
+                for(auto pattern : patterns) {
+                        vector<String> found;
+                        glob(input + "/" + pattern, found, false);
+                        videos.insert(videos.end(), found.begin(), found.end());
+                }
+                sort(videos.begin(), videos.end());
+                return true;
+        }
+
+        ifstream is(input);
+        if (!is.is_open()) return false;
+
+        string line;
+        while(getline(is, line)) {
+                if (line != "" && line[0] != '#') videos.push_back(line);
+        }
+        return true;
+}
+
+bool file_exists(const string &filename) {
+        struct stat info;
+        return stat(filename.c_str(), &info) == 0;
+}
+
+// File with the detections of a segment until the file is done
+string part_name(const BatchFile &file, int part) {
+        return file.output + "." + std::to_string(part) + ".part";
+}
+
+// Split a file into segments of segment_frames frames
+//
+// Without a frame count, with segment_frames 0, or if the capture cannot
+// seek to the start of the second segment exactly, the whole file is a
+// single segment
+vector<Segment> split_file(BatchFile &file, int64_t segment_frames) {
+        int64_t frame_count = 0;
+        if (segment_frames > 0) {
+                VideoCapture capture(file.input);
+                if (capture.isOpened())
+                        frame_count = int64_t(capture.get(CV_CAP_PROP_FRAME_COUNT));
+                if (frame_count > segment_frames && !seeks_exactly(capture, segment_frames)) {
+                        cerr << "Cannot seek exactly in \"" + file.input + "\", processing it as a single segment" << endl;
+                        frame_count = 0;
+                }
+        }
+
+        vector<Segment> segments;
+        if (frame_count <= segment_frames) {
+                segments.push_back(Segment{&file, 0, 0, -1});
+        } else {
+                for(int64_t begin = 0; begin < frame_count; begin += segment_frames) {
+                        // The last segment reads until the end, in case the count is short
+                        int64_t end = begin + segment_frames < frame_count ? begin + segment_frames : -1;
+                        segments.push_back(Segment{&file, int(segments.size()), begin, end});
+                }
+        }
+
+        file.segments = segments.size();
+        file.segments_left = file.segments;
+        return segments;
+}
+
+// Whether the capture lands on frame after seeking to it
+//
+// Seeking goes back to the keyframe before the frame and decodes
+// forward, but with B-frames or a variable frame rate FFmpeg may land
+// elsewhere, and the segments would then overlap or leave gaps
+bool seeks_exactly(VideoCapture &capture, int64_t frame) {
+        return capture.set(CV_CAP_PROP_POS_FRAMES, double(frame))
+                && int64_t(capture.get(CV_CAP_PROP_POS_FRAMES)) == frame;
+}
+
+// Detect the markers of the frames of a segment and write them to its part file
+//
+// The capture seeks to the first frame of the segment, and fails if it
+// does not land on it. A segment other than the last one must have all
+// of its frames, so the detections of a file have no gaps.
+// Return the number of frames processed, -1 if the segment failed
+int64_t process_segment(const Segment &segment, BatchWorker &worker, const BatchContext &context) {
+        VideoCapture capture(segment.file->input);
+        if (!capture.isOpened()) return -1;
+
+        if (segment.begin > 0 && !seeks_exactly(capture, segment.begin))
+                return -1;
+
+        ofstream os(part_name(*segment.file, segment.part));
+        if (!os.is_open()) return -1;
+
+        Frame &frame = worker.frame;
+        int64_t index = segment.begin;
+
+        for(; segment.end < 0 || index < segment.end; ++index) {
+                if (!capture.read(frame.image)) break;
+
+                frame.index = index;
+                prepare_frame(frame);
+                find_markers(frame, context.pyramid_level, worker.scratch);
+                decode_markers(frame, context.decoding_table);
+                estimate_poses(frame, context.camera, nullptr, worker.scratch.pose);
+
+                write_detections(os, frame);
+        }
+
+        if (!os.good()) return -1;
+        if (segment.end >= 0 && index < segment.end) return -1;
+        return index - segment.begin;
+}
+
+// Join the part files of a file into its detections file
+//
+// The parts are first joined into a temporary file that is then
+// renamed, so the detections file is never left half written
+bool join_parts(const BatchFile &file) {
+        string joined = file.output + ".part";
+        {
+                ofstream os(joined, ios::binary);
+                if (!os.is_open()) return false;
+
+                for(int part = 0; part < file.segments; ++part) {
+                        ifstream is(part_name(file, part), ios::binary);
+                        if (!is.is_open()) return false;
+
+                        // Copying an empty stream would set the failbit of os
+                        if (is.peek() != ifstream::traits_type::eof())
+                                os << is.rdbuf();
+                }
+                if (!os.good()) return false;
+        }
+
+        for(int part = 0; part < file.segments; ++part) {
+                remove(part_name(file, part).c_str());
+        }
+        return rename(joined.c_str(), file.output.c_str()) == 0;
+}
@@ -0,0 +1,325 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decoding_table.hpp"
+
+TableStorage::~TableStorage() {
+        if (mapping) munmap(mapping, mapping_size);
+}
+
+// Build the index of the codes of a dictionary
+//
+// Every code that differs in at most max_distance bits from a marker is
+// added with the id of the closest marker and its distance. Codes
+// equally close to two markers have an id of -1. The rotations are not
+// added, lookup_marker turns the code it reads instead.
+// The tolerance is limited by usable_distance, the table keeps the one
+// used.
+// The codes are not copied and must outlive the table
+void build_decoding_table(DecodingTable &decoding_table, const uint64_t *codes, int num_markers, int bits, int max_distance) {
+        max_distance = usable_distance(codes, num_markers, bits, max_distance);
+
+        const size_t slots = table_slots(num_markers, bits, max_distance);
+        int slot_bits = 1;
+        while ((size_t(1) << slot_bits) < slots) slot_bits++;
+
+        std::shared_ptr<TableStorage> storage(new TableStorage());
+        storage->keys.assign(size_t(1) << slot_bits, 0);
+        storage->values.assign(size_t(1) << slot_bits, MarkerCode{-1, 0, 0});
+
+        const size_t mask = (size_t(1) << slot_bits) - 1;
+        const int shift = 64 - slot_bits;
+
+        for(int m = 0; m < num_markers; ++m) {
+                add_neighbours(*storage, mask, shift, bits, codes[m], m, 0, 0, max_distance);
+        }
+
+        decoding_table.bits = bits;
+        decoding_table.num_markers = num_markers;
+        decoding_table.max_distance = max_distance;
+        decoding_table.codes = codes;
+        decoding_table.keys = storage->keys.data();
+        decoding_table.values = storage->values.data();
+        decoding_table.mask = mask;
+        decoding_table.shift = shift;
+        decoding_table.storage = storage;
+}
+
+// Largest tolerance up to max_distance worth a table for a dictionary
+//
+// A code further than half the smallest distance between two markers
+// from its marker may be as close to another one, so max_distance is
+// lowered to that, where every further entry would be ambiguous. It is
+// lowered more if the table would not fit in MAX_TABLE_BYTES, with a
+// warning
+int usable_distance(const uint64_t *codes, int num_markers, int bits, int max_distance) {
+        const int requested = max_distance;
+        max_distance = max(0, min(max_distance, bits * bits));
+        max_distance = min(max_distance, max(0, (min_code_distance(codes, num_markers, bits) - 1) / 2));
+
+        const size_t slot_size = sizeof(uint64_t) + sizeof(MarkerCode);
+        while (max_distance > 0 && table_slots(num_markers, bits, max_distance) * slot_size > MAX_TABLE_BYTES) {
+                max_distance--;
+        }
+        if (max_distance < requested)
+                cerr << "Tolerance of " << requested << " bits lowered to " << max_distance
+                     << " for a dictionary of " << num_markers << " markers of " << bits << "x" << bits << " bits" << endl;
+        return max_distance;
+}
+
+// Smallest number of bits in which a marker differs from another one,
+// or from itself turned
+//
+// Codes are compared with every rotation of the others, as they are
+// looked up. The code bits of a single marker with no symmetry are the
+// distance
+int min_code_distance(const uint64_t *codes, int num_markers, int bits) {
+        int distance = bits * bits;
+
+        for(int m = 0; m < num_markers; ++m) {
+                uint64_t rotated = codes[m];
+                for(int rotation = 0; rotation < 4; ++rotation) {
+                        for(int other = rotation == 0 ? m + 1 : m; other < num_markers; ++other) {
+                                distance = min(distance, __builtin_popcountll(rotated ^ codes[other]));
+                        }
+                        rotated = rotate_code(rotated, bits);
+                }
+        }
+        return distance;
+}
+
+// Slots of the table of a dictionary for a tolerance of max_distance
+//
+// Every marker has sum of binomial(bits^2, k) codes within max_distance.
+// At most half of the slots are used so that the probes stay short
+size_t table_slots(int num_markers, int bits, int max_distance) {
+        const int code_bits = bits * bits;
+        size_t neighbours = 0;
+        size_t combinations = 1;
+        for(int k = 0; k <= max_distance; ++k) {
+                neighbours += combinations;
+                combinations = combinations * (code_bits - k) / (k + 1);
+        }
+
+        size_t slots = 2;
+        while (slots < 2 * neighbours * size_t(num_markers)) slots <<= 1;
+        return slots;
+}
+
+// Map a dictionary file and use its lookup table
+//
+// The file is mapped read only and shared, so every process using the
+// same dictionary shares its pages. If the file has no lookup table, or
+// one for another tolerance, the table is built in memory from the
+// mapped codes.
+// Return false if the file cannot be mapped, is not a valid dictionary
+// or its table holds an id outside the dictionary
+bool load_dictionary(const string &filename, DecodingTable &decoding_table, int max_distance) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(DictionaryHeader)) {
+                close(fd);
+                return false;
+        }
+
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return false;
+
+        std::shared_ptr<TableStorage> storage(new TableStorage());
+        storage->mapping = mapping;
+        storage->mapping_size = info.st_size;
+
+        const uint8_t *data = static_cast<const uint8_t *>(mapping);
+        const DictionaryHeader &header = *reinterpret_cast<const DictionaryHeader *>(data);
+
+        if (memcmp(header.magic, DICTIONARY_MAGIC, sizeof(header.magic)) != 0
+                || header.version != DICTIONARY_VERSION
+                || header.marker_bits < 1 || header.marker_bits > MAX_MARKER_BITS
+                || header.num_markers < 1 || header.num_markers > INT16_MAX
+                || header.slot_bits > 40)
+                return false;
+
+        // A table needs a slot for every marker at least
+        bool has_table = header.table_distance >= 0;
+        if (has_table && (header.slot_bits < 1 || (size_t(1) << header.slot_bits) < header.num_markers))
+                return false;
+
+        size_t codes_end = sizeof(DictionaryHeader) + header.num_markers * sizeof(uint64_t);
+        size_t slots = size_t(1) << header.slot_bits;
+        size_t table_end = codes_end + slots * (sizeof(uint64_t) + sizeof(MarkerCode));
+
+        if (storage->mapping_size < (has_table ? table_end : codes_end)) return false;
+
+        const uint64_t *codes = reinterpret_cast<const uint64_t *>(data + sizeof(DictionaryHeader));
+        max_distance = usable_distance(codes, header.num_markers, header.marker_bits, max_distance);
+
+        if (has_table && header.table_distance == max_distance) {
+                // Every id of the table must be a marker, or -1 for an ambiguous code
+                const uint64_t *keys = reinterpret_cast<const uint64_t *>(data + codes_end);
+                const MarkerCode *values = reinterpret_cast<const MarkerCode *>(data + codes_end + slots * sizeof(uint64_t));
+                for(size_t slot = 0; slot < slots; ++slot) {
+                        if (keys[slot] != 0 && (values[slot].id < -1 || int(values[slot].id) >= int(header.num_markers)))
+                                return false;
+                }
+
+                decoding_table.bits = header.marker_bits;
+                decoding_table.num_markers = header.num_markers;
+                decoding_table.max_distance = header.table_distance;
+                decoding_table.codes = codes;
+                decoding_table.keys = reinterpret_cast<const uint64_t *>(data + codes_end);
+                decoding_table.values = reinterpret_cast<const MarkerCode *>(data + codes_end + slots * sizeof(uint64_t));
+                decoding_table.mask = slots - 1;
+                decoding_table.shift = 64 - header.slot_bits;
+                decoding_table.storage = storage;
+                return true;
+        }
+
+        build_decoding_table(decoding_table, codes, header.num_markers, header.marker_bits, max_distance);
+
+        // The new table points into the mapping, which must stay mapped
+        std::shared_ptr<TableStorage> built = std::const_pointer_cast<TableStorage>(decoding_table.storage);
+        built->mapping = storage->mapping;
+        built->mapping_size = storage->mapping_size;
+        storage->mapping = nullptr;
+        return true;
+}
+
+// Write a dictionary file
+//
+// With a table_distance of 0 or more the lookup table for that tolerance
+// is stored as well, so loading the file builds nothing.
+// Return false if the file cannot be written
+bool write_dictionary(const string &filename, const uint64_t *codes, int num_markers, int bits, int table_distance) {
+        ofstream os(filename, ios::binary);
+        if (!os.is_open()) return false;
+
+        DictionaryHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DICTIONARY_MAGIC, sizeof(header.magic));
+        header.version = DICTIONARY_VERSION;
+        header.marker_bits = bits;
+        header.num_markers = num_markers;
+        header.table_distance = -1;
+
+        DecodingTable decoding_table;
+        if (table_distance >= 0) {
+                build_decoding_table(decoding_table, codes, num_markers, bits, table_distance);
+                header.table_distance = decoding_table.max_distance;
+                header.slot_bits = 64 - decoding_table.shift;
+        }
+
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char *>(codes), num_markers * sizeof(uint64_t));
+
+        if (table_distance >= 0) {
+                size_t slots = decoding_table.mask + 1;
+                os.write(reinterpret_cast<const char *>(decoding_table.keys), slots * sizeof(uint64_t));
+                os.write(reinterpret_cast<const char *>(decoding_table.values), slots * sizeof(MarkerCode));
+        }
+        return os.good();
+}
+
+// Add a code and every code that differs from it in the bits from
+// first_bit on, up to max_distance bits in total
+//
+// A code already in the table keeps the closest marker
+void add_neighbours(TableStorage &storage, size_t mask, int shift, int bits, uint64_t code, int id, int first_bit, int distance, int max_distance) {
+        size_t slot = find_slot(storage.keys.data(), mask, shift, code);
+        // Never the case, at most half of the slots are used
+        if (slot > mask) return;
+        MarkerCode &entry = storage.values[slot];
+
+        if (storage.keys[slot] == 0) {
+                storage.keys[slot] = code + 1;
+                entry = MarkerCode{int16_t(id), 0, uint8_t(distance)};
+        } else if (distance < entry.distance) {
+                entry = MarkerCode{int16_t(id), 0, uint8_t(distance)};
+        } else if (distance == entry.distance && entry.id != id) {
+                entry.id = -1;
+        }
+
+        if (distance == max_distance) return;
+
+        for(int b = first_bit; b < bits * bits; ++b) {
+                add_neighbours(storage, mask, shift, bits, code ^ (uint64_t(1) << b), id, b + 1, distance + 1, max_distance);
+        }
+}
+
+// Slot of a code in the table, or the empty slot where it would go
+//
+// The keys are the codes plus 1, so that 0 marks the empty slots.
+// Every slot is probed at most once, so a full table, which a corrupted
+// file may have, ends the search.
+// Return mask + 1 if the code is not in a full table
+size_t find_slot(const uint64_t *keys, size_t mask, int shift, uint64_t code) {
+        size_t slot = size_t((code * 0x9E3779B97F4A7C15ull) >> shift);
+
+        for(size_t probe = 0; probe <= mask; ++probe) {
+                if (keys[slot] == 0 || keys[slot] == code + 1) return slot;
+                slot = (slot + 1) & mask;
+        }
+        return mask + 1;
+}
+
+// Turn the code of a marker of bits x bits cells a quarter clockwise
+//
+// The cell at row c and column r comes from row n - 1 - r and column c
+uint64_t rotate_code(uint64_t code, int bits) {
+        const int n = bits;
+        uint64_t rotated = 0;
+
+        for(int c = 0; c < n; ++c) {
+                for(int r = 0; r < n; ++r) {
+                        if((code >> ((n - 1 - r) * n + c)) & 1)
+                                rotated |= uint64_t(1) << (c * n + r);
+                }
+        }
+        return rotated;
+}
+
+// Identify the code read from a marker
+//
+// The code is turned back a quarter at a time and looked up each time,
+// the rotation is the number of quarters the marker was turned
+// counterclockwise. Return an id of -1 if no rotation is within the
+// tolerance, or if the closest ones are equally close
+MarkerCode lookup_marker(const DecodingTable &decoding_table, uint64_t code) {
+        MarkerCode best = MarkerCode{-1, 0, 0};
+        bool found = false, ambiguous = false;
+
+        for(int rotation = 0; rotation < 4; ++rotation) {
+                size_t slot = find_slot(decoding_table.keys, decoding_table.mask, decoding_table.shift, code);
+
+                if (slot <= decoding_table.mask && decoding_table.keys[slot] != 0) {
+                        const MarkerCode &entry = decoding_table.values[slot];
+                        // -1 is a code equally close to two markers, any
+                        // other id outside the dictionary is a miss
+                        if (entry.id < -1 || entry.id >= decoding_table.num_markers) {
+                                code = rotate_code(code, decoding_table.bits);
+                                continue;
+                        }
+
+                        if (!found || entry.distance < best.distance) {
+                                best = MarkerCode{entry.id, uint8_t(rotation), entry.distance};
+                                ambiguous = entry.id == -1;
+                                found = true;
+                        } else if (entry.distance == best.distance) {
+                                ambiguous = true;
+                        }
+                }
+                code = rotate_code(code, decoding_table.bits);
+        }
+
+        if (ambiguous) return MarkerCode{-1, 0, 0};
+        return best;
+}
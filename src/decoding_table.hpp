@@ -0,0 +1,84 @@
+#ifndef _DECODING_TABLE_H
+#define _DECODING_TABLE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "aruco.hpp"
+
+// Largest side of the code of a marker, so that it fits in 64 bits
+#define MAX_MARKER_BITS 7
+
+// Dictionary files start with this magic and version
+#define DICTIONARY_MAGIC "ARUCODIC"
+#define DICTIONARY_VERSION 1
+
+// Largest lookup table built, in bytes. The tolerance is lowered until
+// the table fits
+#define MAX_TABLE_BYTES (size_t(64) << 20)
+
+// Header of a dictionary file
+//
+// The header is followed by the num_markers codes, as uint64_t, and by
+// the lookup table when table_distance is not -1: 2^slot_bits keys, as
+// uint64_t, and 2^slot_bits MarkerCode. Every field is in the byte
+// order of the host that wrote it
+struct DictionaryHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t marker_bits;
+        uint32_t num_markers;
+        int32_t table_distance;
+        uint32_t slot_bits;
+        uint32_t reserved;
+};
+
+// Memory behind a DecodingTable
+//
+// A mapped dictionary file, the buffers of a table built in memory, or
+// both when a file without a suitable table was loaded
+struct TableStorage {
+        TableStorage() : mapping(nullptr), mapping_size(0) {}
+        ~TableStorage();
+
+        void *mapping;
+        size_t mapping_size;
+        vector<uint64_t> keys;
+        vector<MarkerCode> values;
+};
+
+// Index of the codes read as each marker of a dictionary
+//
+// Every code within the tolerance of a marker, with no rotation, is kept
+// in an open addressing hash table with the marker and its distance.
+// A code read from the frame is looked up once per rotation, so reading
+// a marker costs the same however large the dictionary is.
+// The arrays are read only and may live in a mapped file. Copies share
+// them
+struct DecodingTable {
+        int bits;
+        int num_markers;
+        int max_distance;
+        const uint64_t *codes;
+        const uint64_t *keys;
+        const MarkerCode *values;
+        size_t mask;
+        int shift;
+        std::shared_ptr<const TableStorage> storage;
+};
+
+void build_decoding_table(DecodingTable &decoding_table, const uint64_t *codes, int num_markers, int bits, int max_distance);
+bool load_dictionary(const string &filename, DecodingTable &decoding_table, int max_distance);
+bool write_dictionary(const string &filename, const uint64_t *codes, int num_markers, int bits, int table_distance);
+void add_neighbours(TableStorage &storage, size_t mask, int shift, int bits, uint64_t code, int id, int first_bit, int distance, int max_distance);
+int usable_distance(const uint64_t *codes, int num_markers, int bits, int max_distance);
+int min_code_distance(const uint64_t *codes, int num_markers, int bits);
+size_t table_slots(int num_markers, int bits, int max_distance);
+size_t find_slot(const uint64_t *keys, size_t mask, int shift, uint64_t code);
+uint64_t rotate_code(uint64_t code, int bits);
+MarkerCode lookup_marker(const DecodingTable &decoding_table, uint64_t code);
+
+#endif
@@ -0,0 +1,343 @@
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "detection_log.hpp"
+
+DetectionLogWriter::~DetectionLogWriter() {
+        close();
+}
+
+// Open a log to append to, creating it if it does not exist
+//
+// Return false if the file is not a detection log or cannot be written
+bool DetectionLogWriter::open(const std::string &filename) {
+        struct stat info;
+        bool exists = stat(filename.c_str(), &info) == 0;
+
+        if (exists) {
+                DetectionLog log;
+                if (!log.open(filename)) return false;
+
+                index = log.chunks();
+                if (truncate(filename.c_str(), log.data_end()) != 0) return false;
+                os.open(filename, std::ios::binary | std::ios::app);
+        } else {
+                LogFileHeader file_header;
+                memset(&file_header, 0, sizeof(file_header));
+                memcpy(file_header.magic, LOG_MAGIC, sizeof(file_header.magic));
+                file_header.version = LOG_VERSION;
+
+                os.open(filename, std::ios::binary);
+                os.write(reinterpret_cast<const char *>(&file_header), sizeof(file_header));
+        }
+
+        rows = 0;
+        return os.good();
+}
+
+// Add a detection to the columns of the current chunk
+void DetectionLogWriter::append(uint64_t frame, int64_t timestamp_ns, const MarkerRecord &marker) {
+        if (!os.is_open()) return;
+
+        if (rows == 0) {
+                memset(&header, 0, sizeof(header));
+                header.first_frame = frame;
+                header.first_timestamp = timestamp_ns;
+                header.min_id = marker.id;
+                header.max_id = marker.id;
+                previous_frame = frame;
+                previous_timestamp = timestamp_ns;
+        }
+
+        put_varint(columns[LOG_FRAME], frame - previous_frame);
+        put_varint(columns[LOG_TIMESTAMP], zigzag(timestamp_ns - previous_timestamp));
+        put_varint(columns[LOG_ID], zigzag(marker.id));
+        put_varint(columns[LOG_DISTANCE], zigzag(marker.distance));
+
+        const uint8_t *corners = reinterpret_cast<const uint8_t *>(marker.corners);
+        columns[LOG_CORNERS].insert(columns[LOG_CORNERS].end(), corners, corners + sizeof(marker.corners));
+        const uint8_t *rvec = reinterpret_cast<const uint8_t *>(marker.rvec);
+        columns[LOG_RVEC].insert(columns[LOG_RVEC].end(), rvec, rvec + sizeof(marker.rvec));
+        const uint8_t *tvec = reinterpret_cast<const uint8_t *>(marker.tvec);
+        columns[LOG_TVEC].insert(columns[LOG_TVEC].end(), tvec, tvec + sizeof(marker.tvec));
+
+        header.last_frame = frame;
+        header.last_timestamp = timestamp_ns;
+        header.min_id = std::min(header.min_id, marker.id);
+        header.max_id = std::max(header.max_id, marker.id);
+        header.id_bits |= uint64_t(1) << (uint32_t(marker.id) % 64);
+        previous_frame = frame;
+        previous_timestamp = timestamp_ns;
+
+        if (++rows == LOG_CHUNK_ROWS)
+                flush();
+}
+
+// Write the chunk in one go and flush it to the file
+//
+// The header goes first with the checksum of the columns, so a chunk
+// that was not written whole is found when the log is opened again
+bool DetectionLogWriter::flush() {
+        if (!os.is_open()) return false;
+        if (rows == 0) return true;
+
+        header.magic = LOG_CHUNK_MAGIC;
+        header.rows = rows;
+        header.payload_size = 0;
+
+        header.checksum = fnv1a(nullptr, 0);
+        for(int c = 0; c < LOG_COLUMNS; ++c) {
+                header.column_size[c] = uint32_t(columns[c].size());
+                header.payload_size += header.column_size[c];
+                header.checksum = fnv1a(columns[c].data(), columns[c].size(), header.checksum);
+        }
+
+        LogChunk chunk;
+        chunk.offset = uint64_t(os.tellp());
+        chunk.header = header;
+
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for(auto &column : columns) {
+                os.write(reinterpret_cast<const char *>(column.data()), column.size());
+                column.clear();
+        }
+        os.flush();
+
+        index.push_back(chunk);
+        rows = 0;
+        return os.good();
+}
+
+bool DetectionLogWriter::close() {
+        if (!os.is_open()) return true;
+        bool ok = flush();
+
+        LogTrailer trailer;
+        trailer.index_offset = uint64_t(os.tellp());
+        trailer.chunks = uint32_t(index.size());
+        trailer.magic = LOG_INDEX_MAGIC;
+
+        os.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(LogChunk));
+        os.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+        ok = ok && os.good();
+
+        os.close();
+        index.clear();
+        return ok;
+}
+
+DetectionLog::~DetectionLog() {
+        if (data != nullptr)
+                munmap(const_cast<uint8_t *>(data), size);
+}
+
+// Map the log and find its chunks
+//
+// Return false if the file cannot be mapped or is not a detection log
+bool DetectionLog::open(const std::string &filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(LogFileHeader)) {
+                close(fd);
+                return false;
+        }
+
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return false;
+
+        data = static_cast<const uint8_t *>(mapping);
+        size = info.st_size;
+
+        const LogFileHeader &file_header = *reinterpret_cast<const LogFileHeader *>(data);
+        if (memcmp(file_header.magic, LOG_MAGIC, sizeof(file_header.magic)) != 0 || file_header.version != LOG_VERSION)
+                return false;
+
+        if (!read_index())
+                scan_chunks();
+        return true;
+}
+
+// Use the index written when the log was closed
+//
+// Return false if there is no complete index at the end of the file, or
+// if any entry does not describe a chunk that lies before the index, in
+// order, and whose header in the file is the same as the entry. The
+// chunks are then found by scan_chunks instead
+bool DetectionLog::read_index() {
+        if (size < sizeof(LogFileHeader) + sizeof(LogTrailer)) return false;
+
+        LogTrailer trailer;
+        memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+        if (trailer.magic != LOG_INDEX_MAGIC) return false;
+        if (trailer.index_offset < sizeof(LogFileHeader) || trailer.index_offset > size - sizeof(trailer)
+                || size - sizeof(trailer) - trailer.index_offset != uint64_t(trailer.chunks) * sizeof(LogChunk))
+                return false;
+
+        chunk_index.resize(trailer.chunks);
+        memcpy(chunk_index.data(), data + trailer.index_offset, trailer.chunks * sizeof(LogChunk));
+
+        uint64_t offset = sizeof(LogFileHeader);
+        for(auto &chunk : chunk_index) {
+                if (chunk.offset < offset || !chunk_fits(chunk, trailer.index_offset)
+                        || memcmp(data + chunk.offset, &chunk.header, sizeof(chunk.header)) != 0) {
+                        chunk_index.clear();
+                        return false;
+                }
+                offset = chunk.offset + sizeof(LogChunkHeader) + chunk.header.payload_size;
+        }
+        end = trailer.index_offset;
+        return true;
+}
+
+// Walk the chunks from the start of the file
+//
+// Stop at the first chunk that is not whole or whose columns do not
+// match their checksum, which is where a crash cut the log
+void DetectionLog::scan_chunks() {
+        chunk_index.clear();
+        uint64_t offset = sizeof(LogFileHeader);
+
+        while (offset + sizeof(LogChunkHeader) <= size) {
+                LogChunk chunk;
+                chunk.offset = offset;
+                memcpy(&chunk.header, data + offset, sizeof(chunk.header));
+
+                uint64_t payload = offset + sizeof(LogChunkHeader);
+                if (!chunk_fits(chunk, size) || fnv1a(data + payload, chunk.header.payload_size) != chunk.header.checksum)
+                        break;
+
+                chunk_index.push_back(chunk);
+                offset = payload + chunk.header.payload_size;
+        }
+        end = offset;
+}
+
+// Whether a chunk is whole before limit and its columns add up
+//
+// The corners, rvec and tvec columns must have their fixed size for
+// the rows of the chunk, so the columns can be read without further
+// checks. The checksum is not verified here
+bool DetectionLog::chunk_fits(const LogChunk &chunk, uint64_t limit) const {
+        const LogChunkHeader &header = chunk.header;
+        if (header.magic != LOG_CHUNK_MAGIC || chunk.offset > limit
+                || limit - chunk.offset < sizeof(LogChunkHeader)
+                || limit - chunk.offset - sizeof(LogChunkHeader) < header.payload_size)
+                return false;
+
+        uint64_t columns_size = 0;
+        for(int c = 0; c < LOG_COLUMNS; ++c) columns_size += header.column_size[c];
+        return columns_size == header.payload_size
+                && header.column_size[LOG_CORNERS] == uint64_t(header.rows) * 8 * sizeof(float)
+                && header.column_size[LOG_RVEC] == uint64_t(header.rows) * 3 * sizeof(double)
+                && header.column_size[LOG_TVEC] == uint64_t(header.rows) * 3 * sizeof(double);
+}
+
+// Start of a column of a chunk in the mapping
+const uint8_t *DetectionLog::column(const LogChunk &chunk, int column) const {
+        const uint8_t *p = data + chunk.offset + sizeof(LogChunkHeader);
+        for(int c = 0; c < column; ++c) p += chunk.header.column_size[c];
+        return p;
+}
+
+void DetectionLog::read_frames(const LogChunk &chunk, std::vector<uint64_t> &frames) const {
+        const uint8_t *p = column(chunk, LOG_FRAME);
+        const uint8_t *column_end = p + chunk.header.column_size[LOG_FRAME];
+
+        frames.resize(chunk.header.rows);
+        uint64_t frame = chunk.header.first_frame;
+        for(auto &f : frames) {
+                frame += get_varint(p, column_end);
+                f = frame;
+        }
+}
+
+void DetectionLog::read_timestamps(const LogChunk &chunk, std::vector<int64_t> &timestamps) const {
+        const uint8_t *p = column(chunk, LOG_TIMESTAMP);
+        const uint8_t *column_end = p + chunk.header.column_size[LOG_TIMESTAMP];
+
+        timestamps.resize(chunk.header.rows);
+        int64_t timestamp = chunk.header.first_timestamp;
+        for(auto &t : timestamps) {
+                timestamp += unzigzag(get_varint(p, column_end));
+                t = timestamp;
+        }
+}
+
+void DetectionLog::read_ids(const LogChunk &chunk, std::vector<int32_t> &ids) const {
+        const uint8_t *p = column(chunk, LOG_ID);
+        const uint8_t *column_end = p + chunk.header.column_size[LOG_ID];
+
+        ids.resize(chunk.header.rows);
+        for(auto &id : ids) id = int32_t(unzigzag(get_varint(p, column_end)));
+}
+
+void DetectionLog::read_distances(const LogChunk &chunk, std::vector<int32_t> &distances) const {
+        const uint8_t *p = column(chunk, LOG_DISTANCE);
+        const uint8_t *column_end = p + chunk.header.column_size[LOG_DISTANCE];
+
+        distances.resize(chunk.header.rows);
+        for(auto &d : distances) d = int32_t(unzigzag(get_varint(p, column_end)));
+}
+
+void DetectionLog::read_corners(const LogChunk &chunk, std::vector<float> &corners) const {
+        corners.resize(size_t(chunk.header.rows) * 8);
+        memcpy(corners.data(), column(chunk, LOG_CORNERS), corners.size() * sizeof(float));
+}
+
+void DetectionLog::read_vectors(const LogChunk &chunk, int column_index, std::vector<double> &vectors) const {
+        vectors.resize(size_t(chunk.header.rows) * 3);
+        memcpy(vectors.data(), column(chunk, column_index), vectors.size() * sizeof(double));
+}
+
+// Whether a chunk may hold detections of a marker
+bool chunk_contains_id(const LogChunkHeader &header, int id) {
+        return id >= header.min_id && id <= header.max_id
+                && (header.id_bits >> (uint32_t(id) % 64)) & 1;
+}
+
+// 64 bit FNV-1a hash, continuing from hash
+uint64_t fnv1a(const uint8_t *data, size_t size, uint64_t hash) {
+        for(size_t k = 0; k < size; ++k) {
+                hash = (hash ^ data[k]) * 0x100000001b3ull;
+        }
+        return hash;
+}
+
+// Append a value 7 bits at a time, the high bit set on all but the last byte
+void put_varint(std::vector<uint8_t> &out, uint64_t value) {
+        while (value >= 0x80) {
+                out.push_back(uint8_t(value) | 0x80);
+                value >>= 7;
+        }
+        out.push_back(uint8_t(value));
+}
+
+// Read a value written by put_varint and move past it
+//
+// Return 0 past the end of the column
+uint64_t get_varint(const uint8_t *&p, const uint8_t *end) {
+        uint64_t value = 0;
+        for(int shift = 0; p < end && shift < 64; shift += 7) {
+                uint8_t byte = *p++;
+                value |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) break;
+        }
+        return value;
+}
+
+// Map small negative numbers to small positive ones: 0, -1, 1, -2, ...
+uint64_t zigzag(int64_t value) {
+        return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
@@ -0,0 +1,157 @@
+#ifndef _DETECTION_LOG_H
+#define _DETECTION_LOG_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstddef>
+#include <cstdint>
+
+#include "shm_ring.hpp"
+
+// Detections buffered before they are written as a chunk
+#define LOG_CHUNK_ROWS 4096
+
+// Magic numbers of the file, of each chunk and of the index at the end
+#define LOG_MAGIC "ARUCOLOG"
+#define LOG_VERSION 1
+#define LOG_CHUNK_MAGIC 0x4b4e4843u
+#define LOG_INDEX_MAGIC 0x58444e49u
+
+// Columns of a chunk, one value per detection
+//
+// Frames are stored as the difference with the previous detection,
+// timestamps as the signed difference and ids and distances as they
+// are, all of them as variable length integers. Corners (8 floats) and
+// rvec and tvec (3 doubles each) are stored as is
+enum LogColumn {
+        LOG_FRAME = 0,
+        LOG_TIMESTAMP,
+        LOG_ID,
+        LOG_DISTANCE,
+        LOG_CORNERS,
+        LOG_RVEC,
+        LOG_TVEC,
+        LOG_COLUMNS
+};
+
+// Start of the file
+struct LogFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+};
+
+// Header of a chunk, followed by its columns one after the other
+//
+// The ranges of frames, timestamps and ids let a query skip the chunk
+// without reading it. id_bits has bit id % 64 set for every id in it.
+// The checksum is the FNV-1a hash of the columns, so a chunk cut short
+// by a crash is told apart from a complete one
+struct LogChunkHeader {
+        uint32_t magic;
+        uint32_t rows;
+        uint64_t first_frame;
+        uint64_t last_frame;
+        int64_t first_timestamp;
+        int64_t last_timestamp;
+        int32_t min_id;
+        int32_t max_id;
+        uint64_t id_bits;
+        uint32_t column_size[LOG_COLUMNS];
+        uint32_t payload_size;
+        uint64_t checksum;
+};
+
+// Entry of the index at the end of the file
+struct LogChunk {
+        uint64_t offset;
+        LogChunkHeader header;
+};
+
+// End of the file, after the index entries
+struct LogTrailer {
+        uint64_t index_offset;
+        uint32_t chunks;
+        uint32_t magic;
+};
+
+// Writer of a detection log
+//
+// The detections are kept in columns and written a chunk at a time, so
+// the file only ever grows by whole chunks. The index of the chunks is
+// written at the end when the log is closed.
+// An existing log is appended to. It is first cut after its last
+// complete chunk, which drops its index and whatever a crash left after it
+class DetectionLogWriter {
+public:
+        DetectionLogWriter() : rows(0), previous_frame(0), previous_timestamp(0) {}
+        ~DetectionLogWriter();
+
+        bool open(const std::string &filename);
+        bool is_open() const { return os.is_open(); }
+
+        void append(uint64_t frame, int64_t timestamp_ns, const MarkerRecord &marker);
+
+        // Write the buffered detections as a chunk
+        bool flush();
+
+        // Write the last chunk and the index
+        bool close();
+
+private:
+        std::ofstream os;
+        std::vector<LogChunk> index;
+        std::vector<uint8_t> columns[LOG_COLUMNS];
+        LogChunkHeader header;
+        uint32_t rows;
+        uint64_t previous_frame;
+        int64_t previous_timestamp;
+};
+
+// Read side of a detection log
+//
+// The file is mapped and only the columns asked for are decoded. The
+// index at the end of the file is used if there is one, otherwise the
+// chunks are walked from the start until the first incomplete one
+class DetectionLog {
+public:
+        DetectionLog() : data(nullptr), size(0), end(0) {}
+        ~DetectionLog();
+
+        bool open(const std::string &filename);
+
+        const std::vector<LogChunk> &chunks() const { return chunk_index; }
+
+        // Offset after the last complete chunk
+        uint64_t data_end() const { return end; }
+
+        void read_frames(const LogChunk &chunk, std::vector<uint64_t> &frames) const;
+        void read_timestamps(const LogChunk &chunk, std::vector<int64_t> &timestamps) const;
+        void read_ids(const LogChunk &chunk, std::vector<int32_t> &ids) const;
+        void read_distances(const LogChunk &chunk, std::vector<int32_t> &distances) const;
+        // 8 floats per detection
+        void read_corners(const LogChunk &chunk, std::vector<float> &corners) const;
+        // 3 doubles per detection, column is LOG_RVEC or LOG_TVEC
+        void read_vectors(const LogChunk &chunk, int column, std::vector<double> &vectors) const;
+
+private:
+        const uint8_t *column(const LogChunk &chunk, int column) const;
+        bool chunk_fits(const LogChunk &chunk, uint64_t limit) const;
+        bool read_index();
+        void scan_chunks();
+
+        const uint8_t *data;
+        size_t size;
+        uint64_t end;
+        std::vector<LogChunk> chunk_index;
+};
+
+bool chunk_contains_id(const LogChunkHeader &header, int id);
+uint64_t fnv1a(const uint8_t *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+void put_varint(std::vector<uint8_t> &out, uint64_t value);
+uint64_t get_varint(const uint8_t *&p, const uint8_t *end);
+uint64_t zigzag(int64_t value);
+int64_t unzigzag(uint64_t value);
+
+#endif
@@ -0,0 +1,1165 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+
+#include "detector.hpp"
+#include "trace.hpp"
+
+// Corners of a marker in cell units, in the order given by detect_arucos
+// A marker is MARKER_CELLS x MARKER_CELLS cells including the black border
+const Point2f MARKER_CELL_VERTEX[4] = {
+        Point2f(MARKER_CELLS, 0), Point2f(0, 0), Point2f(0, MARKER_CELLS), Point2f(MARKER_CELLS, MARKER_CELLS)
+};
+
+// Corners of a marker of side 1 in its own coordinates, x to the right,
+// y up and z out of the marker. This is the order SOLVEPNP_IPPE_SQUARE
+// expects: top left, top right, bottom right and bottom left
+const Point3f MARKER_MODEL_VERTEX[4] = {
+        Point3f(-0.5f, 0.5f, 0), Point3f(0.5f, 0.5f, 0), Point3f(0.5f, -0.5f, 0), Point3f(-0.5f, -0.5f, 0)
+};
+
+// Position of the samples inside a cell. The edges are avoided
+// so that the neighbouring cells do not bleed into the reading
+const double CELL_SAMPLE_OFFSETS[CELL_SAMPLES] = {0.3, 0.5, 0.7};
+
+// Points and edges of a shape drawn over a marker
+//
+// The points are in the coordinates of a marker of side 1, see
+// MARKER_MODEL_VERTEX, and each edge joins two of them
+struct ShapeModel {
+        int num_points;
+        int num_edges;
+        double points[SHAPE_MAX_POINTS][3];
+        int edges[SHAPE_MAX_EDGES][2];
+};
+
+// Shape drawn for each value of Shape
+//
+//   Cube: the corners of the marker and of its upper face
+//   Pyramid: the corners of the marker and the apex above its center
+//   Pyramid inv: the upper face of the cube and the center of the marker
+//   Pyramid side: the left side of the marker, the edge above it and a
+//   point above the middle of the right side
+//   Prism: drawn as the pyramid
+constexpr ShapeModel SHAPE_MODELS[] = {
+        {8, 8,
+         {{-0.5, 0.5, 0}, {0.5, 0.5, 0}, {0.5, -0.5, 0}, {-0.5, -0.5, 0},
+          {-0.5, 0.5, CUBE_HEIGHT}, {0.5, 0.5, CUBE_HEIGHT}, {0.5, -0.5, CUBE_HEIGHT}, {-0.5, -0.5, CUBE_HEIGHT}},
+         {{4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}}},
+        {5, 4,
+         {{-0.5, 0.5, 0}, {0.5, 0.5, 0}, {0.5, -0.5, 0}, {-0.5, -0.5, 0}, {0, 0, PYRAMID_HEIGHT}},
+         {{0, 4}, {1, 4}, {2, 4}, {3, 4}}},
+        {5, 8,
+         {{-0.5, 0.5, CUBE_HEIGHT}, {0.5, 0.5, CUBE_HEIGHT}, {0.5, -0.5, CUBE_HEIGHT}, {-0.5, -0.5, CUBE_HEIGHT}, {0, 0, 0}},
+         {{0, 1}, {1, 2}, {2, 3}, {3, 0}, {0, 4}, {1, 4}, {2, 4}, {3, 4}}},
+        {5, 7,
+         {{-0.5, 0.5, 0}, {-0.5, -0.5, 0}, {-0.5, 0.5, CUBE_HEIGHT}, {-0.5, -0.5, CUBE_HEIGHT}, {0.5, 0, PYRAMID_SIDE_HEIGHT}},
+         {{0, 2}, {1, 3}, {2, 3}, {0, 4}, {1, 4}, {2, 4}, {3, 4}}},
+        {5, 4,
+         {{-0.5, 0.5, 0}, {0.5, 0.5, 0}, {0.5, -0.5, 0}, {-0.5, -0.5, 0}, {0, 0, PYRAMID_HEIGHT}},
+         {{0, 4}, {1, 4}, {2, 4}, {3, 4}}}
+};
+static_assert(sizeof(SHAPE_MODELS) / sizeof(SHAPE_MODELS[0]) == size_t(Shape::Prism_5) + 1,
+        "Every shape needs a model");
+
+template<class V>
+void draw_square(Mat &frame, const V *v, Scalar color=Scalar(0, 255, 255), int thickness=2);
+
+void threshold_image(const Mat &image, Mat &gray, Mat &bw, ThresholdScratch &scratch);
+
+Detector::Detector(const Camera &camera, const DetectorOptions &options)
+        : camera(camera), options(options) {
+        load_decoding_table(decoding_table, options.dictionary, options.tolerance);
+
+        tracker.scan_interval = max(0, options.track_interval);
+        tracker.frames_since_scan = 0;
+
+        input.index = 0;
+}
+
+Detector::Detector(const Camera &camera, const DecodingTable &decoding_table, const DetectorOptions &options)
+        : camera(camera), options(options), decoding_table(decoding_table) {
+        tracker.scan_interval = max(0, options.track_interval);
+        tracker.frames_since_scan = 0;
+
+        input.index = 0;
+}
+
+const vector<Aruco> &Detector::detect(const uint8_t *data, size_t step, int width, int height, int channels) {
+        CV_Assert(channels == 1 || channels == 3);
+
+        // Header over the buffer of the caller, nothing is copied
+        input.image = Mat(height, width, channels == 1 ? CV_8UC1 : CV_8UC3, const_cast<uint8_t *>(data), step);
+        detect_frame(input);
+        input.index++;
+
+        markers.clear();
+        for(auto &aruco : input.arucos) {
+                if (aruco.id != -1) markers.push_back(aruco);
+        }
+        return markers;
+}
+
+const vector<Aruco> &Detector::detect(const Mat &image) {
+        CV_Assert(image.depth() == CV_8U);
+        return detect(image.data, image.step, image.cols, image.rows, image.channels());
+}
+
+// Same steps as the pipeline: find the markers, decode them and compute
+// their pose. With tracking, the markers are first searched around the
+// tracks and the whole frame is only scanned when one is lost or every
+// track_interval frames
+void Detector::detect_frame(Frame &frame) {
+        prepare_frame(frame);
+
+        std::chrono::high_resolution_clock::time_point start_t = std::chrono::high_resolution_clock::now();
+        bool tracked = tracker.scan_interval > 0
+                && !tracker.tracks.empty()
+                && tracker.frames_since_scan < tracker.scan_interval
+                && track_markers(frame, tracker, decoding_table, scratch);
+        int64_t tracking_ns = elapsed_ns(start_t);
+
+        if (tracked) {
+                tracker.frames_since_scan++;
+        } else {
+                frame.arucos.clear();
+                find_markers(frame, options.pyramid_level, scratch);
+
+                start_t = std::chrono::high_resolution_clock::now();
+                decode_markers(frame, decoding_table);
+                frame.decode_ns = elapsed_ns(start_t);
+                tracker.frames_since_scan = 1;
+        }
+        frame.contours_ns += tracking_ns;
+
+        if (options.with_pose) {
+                start_t = std::chrono::high_resolution_clock::now();
+                estimate_poses(frame, camera, tracker.scan_interval > 0 ? &tracker : nullptr, scratch.pose);
+                frame.pose_ns = elapsed_ns(start_t);
+        }
+        frame.decoded = true;
+
+        if (tracker.scan_interval > 0)
+                update_tracks(tracker, frame.arucos);
+}
+
+// Get the buffers of a frame ready for a new image
+//
+// A gray image is used as the gray frame in place
+void prepare_frame(Frame &frame) {
+        if (frame.image.channels() == 1)
+                frame.gray = frame.image;
+        else
+                frame.gray.create(frame.image.size(), CV_8UC1);
+        frame.bw.create(frame.image.size(), CV_8UC1);
+
+        frame.arucos.clear();
+        frame.decoded = false;
+        frame.preprocess_ns = 0;
+        frame.contours_ns = 0;
+        frame.decode_ns = 0;
+        frame.pose_ns = 0;
+}
+
+// Gray image of a frame read with CV_CAP_PROP_CONVERT_RGB off
+//
+// The decoder then gives the format in fourcc. The luma of planar 4:2:0
+// frames (NV12, NV21, I420, YV12) is their first plane and is used in
+// place. The luma of packed 4:2:2 frames is copied out, it is the first
+// byte of each pair in YUYV and YVYU and the second one in UYVY and
+// VYUY. Backends that do not support raw frames still give BGR, which is
+// converted. Only when the backend gives no fourcc (0 or -1) is the format
+// guessed from the size of the buffer.
+// Return false if the format is not known or the buffer is too small
+bool luma_plane(const Mat &raw, int fourcc, Size size, Mat &gray) {
+        if (raw.size() == size && raw.type() == CV_8UC1) {
+                gray = raw;
+                return true;
+        }
+        if (raw.size() == size && raw.type() == CV_8UC3) {
+                gray.create(size, CV_8UC1);
+                bgr_to_gray(raw.data, raw.step, gray.data, gray.step, size.width, size.height);
+                return true;
+        }
+        if (!raw.isContinuous() || raw.depth() != CV_8U) return false;
+
+        // Some backends give the whole buffer as a single row
+        const size_t pixels = size_t(size.width) * size.height;
+        const size_t bytes = raw.total() * raw.elemSize();
+
+        bool planar = false, packed = false;
+        int offset = 0;
+        if (fourcc == CV_FOURCC('N', 'V', '1', '2') || fourcc == CV_FOURCC('N', 'V', '2', '1')
+                || fourcc == CV_FOURCC('I', '4', '2', '0') || fourcc == CV_FOURCC('I', 'Y', 'U', 'V')
+                || fourcc == CV_FOURCC('Y', 'V', '1', '2')) {
+                planar = true;
+        } else if (fourcc == CV_FOURCC('Y', 'U', 'Y', 'V') || fourcc == CV_FOURCC('Y', 'U', 'Y', '2')
+                || fourcc == CV_FOURCC('Y', 'V', 'Y', 'U')) {
+                packed = true;
+        } else if (fourcc == CV_FOURCC('U', 'Y', 'V', 'Y') || fourcc == CV_FOURCC('V', 'Y', 'U', 'Y')) {
+                packed = true;
+                offset = 1;
+        } else if (fourcc <= 0) {
+                planar = bytes == pixels * 3 / 2;
+                packed = bytes == pixels * 2;
+        } else {
+                return false;
+        }
+
+        if (planar && bytes >= pixels * 3 / 2) {
+                gray = Mat(size, CV_8UC1, raw.data);
+                return true;
+        }
+        if (packed && bytes >= pixels * 2) {
+                gray.create(size, CV_8UC1);
+                packed_luma(raw.data, size_t(size.width) * 2, gray.data, gray.step, size.width, size.height, offset);
+                return true;
+        }
+        return false;
+}
+
+// Threshold a BGR image and convert it to gray in the same pass, or
+// threshold a gray image, which is already its own gray frame
+void threshold_image(const Mat &image, Mat &gray, Mat &bw, ThresholdScratch &scratch) {
+        if (image.channels() == 1) {
+                adaptive_threshold<THRESH_BLOCK_SIZE, THRESH_C>(
+                        image.data, image.step,
+                        bw.data, bw.step,
+                        image.cols, image.rows, scratch);
+        } else {
+                gray_adaptive_threshold<THRESH_BLOCK_SIZE, THRESH_C>(
+                        image.data, image.step,
+                        gray.data, gray.step,
+                        bw.data, bw.step,
+                        image.cols, image.rows, scratch);
+        }
+}
+
+// Find the possible aruco markers in the whole frame
+//
+// Convert the camera frame to gray scale
+//
+// Threshold the image to dectect the contours
+//
+// From all contours detected, discard the ones that are not Aruco markers
+//
+// With a pyramid level above 0 the contours are searched in a reduced
+// copy of the frame and the corners are then refined at full resolution
+//
+// The time taken by the preprocessing and by the contours is saved in the frame
+void find_markers(Frame &frame, int pyramid_level, DetectScratch &scratch) {
+        TRACE_SCOPE("find_markers");
+        std::chrono::high_resolution_clock::time_point start_t = std::chrono::high_resolution_clock::now();
+
+        if (pyramid_level == 0) {
+                //
+                // Preprocess
+                //
+                // Same as cvtColor(CV_BGR2GRAY) followed by
+                // adaptiveThreshold(ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV)
+                // in a single pass over the frame
+                //
+                threshold_image(frame.image, frame.gray, frame.bw, scratch.threshold);
+                frame.preprocess_ns = elapsed_ns(start_t);
+
+                //
+                // Aruco detection
+                //
+                start_t = std::chrono::high_resolution_clock::now();
+                detect_arucos(frame.bw, frame.arucos, scratch.contours);
+                suppress_duplicates(frame.arucos, scratch.contours);
+        } else {
+                if (frame.image.channels() == 3)
+                        bgr_to_gray(frame.image.data, frame.image.step,
+                                frame.gray.data, frame.gray.step,
+                                frame.image.cols, frame.image.rows);
+
+                double scale = 1.0 / (1 << pyramid_level);
+                resize(frame.gray, scratch.small_gray, Size(), scale, scale, INTER_AREA);
+
+                scratch.small_bw.create(scratch.small_gray.size(), CV_8UC1);
+                adaptive_threshold<THRESH_BLOCK_SIZE, THRESH_C>(
+                        scratch.small_gray.data, scratch.small_gray.step,
+                        scratch.small_bw.data, scratch.small_bw.step,
+                        scratch.small_gray.cols, scratch.small_gray.rows, scratch.threshold);
+                frame.preprocess_ns = elapsed_ns(start_t);
+
+                //
+                // Aruco detection
+                //
+                start_t = std::chrono::high_resolution_clock::now();
+                detect_arucos(scratch.small_bw, frame.arucos, scratch.contours, pyramid_level);
+                suppress_duplicates(frame.arucos, scratch.contours);
+                refine_corners(frame.gray, frame.arucos, pyramid_level);
+        }
+        frame.contours_ns = elapsed_ns(start_t);
+}
+
+// Search the tracked markers around their predicted position
+//
+// Only a region around each marker is converted, thresholded and
+// searched for contours. The candidate with the same id closest to the
+// prediction is kept. Tracks of the same id whose regions overlap find
+// the same markers, so a marker already kept for another track is
+// skipped, as suppress_duplicates would drop it.
+// Return false as soon as a marker is not found
+bool track_markers(Frame &frame, const Tracker &tracker, const DecodingTable &decoding_table, DetectScratch &scratch) {
+        TRACE_SCOPE("track_markers");
+        Rect bounds(0, 0, frame.image.cols, frame.image.rows);
+        const size_t first = frame.arucos.size();
+
+        for(auto &track : tracker.tracks) {
+                array<Point2f, 4> predicted;
+                for(size_t v = 0; v < predicted.size(); ++v) {
+                        predicted[v] = track.marker.vertex[v] + track.velocity;
+                }
+                Point2f predicted_center = Point2f(track.marker.center) + track.velocity;
+
+                Rect roi = boundingRect(Mat(4, 1, CV_32FC2, predicted.data()));
+                int margin = max(TRACK_MIN_MARGIN, max(roi.width, roi.height) / 2);
+                roi = Rect(roi.x - margin, roi.y - margin, roi.width + 2 * margin, roi.height + 2 * margin) & bounds;
+                if (roi.empty()) return false;
+
+                Mat image_roi = frame.image(roi);
+                Mat gray_roi = frame.gray(roi);
+                Mat bw_roi = frame.bw(roi);
+
+                threshold_image(image_roi, gray_roi, bw_roi, scratch.threshold);
+
+                scratch.candidates.clear();
+                detect_arucos(bw_roi, scratch.candidates, scratch.contours, 0, roi.tl());
+                suppress_duplicates(scratch.candidates, scratch.contours);
+
+                Aruco *best = nullptr;
+                double best_distance = 0;
+
+                for(auto &candidate : scratch.candidates) {
+                        MarkerCode code = read_marker_dictionary(frame.gray, candidate, decoding_table);
+                        if (code.id != track.marker.id) continue;
+
+                        bool taken = false;
+                        double limit = DUPLICATE_DISTANCE * norm(candidate.vertex[1] - candidate.vertex[0]);
+                        for(size_t a = first; a < frame.arucos.size() && !taken; ++a) {
+                                taken = frame.arucos[a].id == code.id
+                                        && norm(Point2f(frame.arucos[a].center - candidate.center)) <= limit;
+                        }
+                        if (taken) continue;
+
+                        candidate.id = code.id;
+                        candidate.rotation = code.rotation;
+                        candidate.distance = code.distance;
+
+                        double distance = norm(Point2f(candidate.center) - predicted_center);
+                        if (best == nullptr || distance < best_distance) {
+                                best = &candidate;
+                                best_distance = distance;
+                        }
+                }
+
+                if (best == nullptr) return false;
+                frame.arucos.push_back(*best);
+        }
+        return true;
+}
+
+// Replace the tracks with the markers identified in the last frame
+//
+// The velocity of each marker is taken from the closest track with the same id
+void update_tracks(Tracker &tracker, const vector<Aruco> &arucos) {
+        vector<Track> &updated = tracker.updated;
+        updated.clear();
+
+        for(auto &aruco : arucos) {
+                if (aruco.id == -1) continue;
+
+                Track track;
+                track.marker = aruco;
+                track.velocity = Point2f(0, 0);
+
+                const Track *previous = find_track(tracker, aruco);
+                if (previous)
+                        track.velocity = Point2f(aruco.center - previous->marker.center);
+
+                updated.push_back(track);
+        }
+
+        tracker.tracks.swap(updated);
+}
+
+// Return the track with the same id closest to the marker
+//
+// Return nullptr if no marker with that id is being tracked
+const Track *find_track(const Tracker &tracker, const Aruco &aruco) {
+        const Track *best = nullptr;
+        double best_distance = 0;
+
+        for(auto &track : tracker.tracks) {
+                if (track.marker.id != aruco.id) continue;
+
+                double distance = norm(Point2f(aruco.center - track.marker.center));
+                if (best == nullptr || distance < best_distance) {
+                        best = &track;
+                        best_distance = distance;
+                }
+        }
+        return best;
+}
+
+// Compute the pose of every identified marker of the frame
+void estimate_poses(Frame &frame, const Camera &camera, const Tracker *tracker, PoseScratch &scratch) {
+        estimate_poses(frame.arucos, camera, tracker, scratch);
+}
+
+// Compute the pose of every identified marker at once
+//
+// The corners of all the markers are undistorted together and the
+// squares solved in closed form by solve_square_poses, instead of a
+// solvePnP per marker. Both poses of each marker are kept, the one with
+// the smallest reprojection error first.
+// With a tracker the pose whose normal is closest to the one of the
+// track of the marker comes first instead, as long as the marker was
+// seen with the same rotation. The two poses of a marker far away or
+// seen straight on fit its image about as well, and the error alone
+// would make it flip between frames
+void estimate_poses(vector<Aruco> &arucos, const Camera &camera, const Tracker *tracker, PoseScratch &scratch) {
+        TRACE_SCOPE("estimate_poses");
+        vector<Point2f> &corners = scratch.corners;
+        vector<Point2f> &normalized = scratch.normalized;
+        vector<SquarePoses> &poses = scratch.poses;
+
+        corners.clear();
+        for(auto &aruco : arucos) {
+                if (aruco.id == -1) continue;
+
+                array<Point2f, 4> model_corners;
+                marker_model_corners(aruco, model_corners);
+                corners.insert(corners.end(), model_corners.begin(), model_corners.end());
+        }
+        if (corners.empty()) return;
+
+        const size_t n = corners.size() / 4;
+        normalized.resize(corners.size());
+        poses.resize(n);
+
+        Mat normalized_mat(int(normalized.size()), 1, CV_32FC2, normalized.data());
+        undistortPoints(Mat(int(corners.size()), 1, CV_32FC2, corners.data()), normalized_mat,
+                camera.camMatrix, camera.distCoeffs);
+        solve_square_poses(reinterpret_cast<const float *>(normalized.data()), n, camera.marker_size, poses.data());
+
+        size_t m = 0;
+        for(auto &aruco : arucos) {
+                if (aruco.id == -1) continue;
+                const SquarePoses &pose = poses[m++];
+
+                int best = 0;
+                const Track *track = tracker ? find_track(*tracker, aruco) : nullptr;
+                if (track && track->marker.rotation == aruco.rotation) {
+                        double previous[3], normal[2][3];
+                        rvec_normal(track->marker.rvec.val, previous);
+                        rvec_normal(pose.solutions[0].rvec, normal[0]);
+                        rvec_normal(pose.solutions[1].rvec, normal[1]);
+
+                        double dot0 = previous[0] * normal[0][0] + previous[1] * normal[0][1] + previous[2] * normal[0][2];
+                        double dot1 = previous[0] * normal[1][0] + previous[1] * normal[1][1] + previous[2] * normal[1][2];
+                        if (dot1 > dot0) best = 1;
+                }
+
+                const SquarePose &first = pose.solutions[best];
+                const SquarePose &second = pose.solutions[1 - best];
+                aruco.rvec = Vec3d(first.rvec[0], first.rvec[1], first.rvec[2]);
+                aruco.tvec = Vec3d(first.tvec[0], first.tvec[1], first.tvec[2]);
+                aruco.rvec_alt = Vec3d(second.rvec[0], second.rvec[1], second.rvec[2]);
+                aruco.tvec_alt = Vec3d(second.tvec[0], second.tvec[1], second.tvec[2]);
+        }
+}
+
+// Corners of the marker in the order of MARKER_MODEL_VERTEX
+//
+// The order takes the rotation of the marker into account, so the pose
+// follows the marker and not the order in which its contour was found
+void marker_model_corners(const Aruco &aruco, array<Point2f, 4> &corners) {
+        // Cell coordinates of each vertex relative to the center of the
+        // marker, turned back to the unrotated marker. rotation + 1 is
+        // the marker turned a quarter counterclockwise
+        for(int k = 0; k < 4; ++k) {
+                float x = MARKER_CELL_VERTEX[k].x - MARKER_CELLS / 2.0f;
+                float y = MARKER_CELL_VERTEX[k].y - MARKER_CELLS / 2.0f;
+
+                for(int r = 0; r < aruco.rotation; ++r) {
+                        float t = x;
+                        x = -y;
+                        y = t;
+                }
+
+                // Cells go downwards, the model goes upwards
+                int corner = y < 0 ? (x < 0 ? 0 : 1) : (x > 0 ? 2 : 3);
+                corners[corner] = aruco.vertex[k];
+        }
+}
+
+// Read the text file containing the camera matrix and the distortion coefficients
+//
+// The first line of the file are the 9 values of the camera matrix.
+// The second line are the 5 distortion coefficients
+// See https://docs.opencv.org/2.4/doc/tutorials/calib3d/camera_calibration/camera_calibration.html
+void calibrate_camera(String filename, Mat &camMatrix, Mat &distCoeffs) {
+        ifstream fs(filename);
+
+        if(fs.is_open()) {
+                double camData[9], distData[5];
+                
+                for(int e = 0; e < 9; ++e) fs >> camData[e];
+                for(int e = 0; e < 5; ++e) fs >> distData[e];
+
+                Mat camMatrixTemp(3, 3, DataType<double>::type, camData);
+                Mat distCoeffsTemp(5, 1, cv::DataType<double>::type, distData);
+
+                camMatrixTemp.copyTo(camMatrix);
+                distCoeffsTemp.copyTo(distCoeffs);
+                
+                cout << camMatrix << endl;
+                cout << distCoeffs << endl;
+                cout << "Camera calibrated correctly" << endl;
+
+                fs.close();
+        } else {
+                cerr << "File \"" + filename + "\" does not exist " << endl;
+                exit(1);
+        }
+}
+
+// Given a camera frame detect the aruco markes on it
+//
+// From all of the contours of the image discard the ones that are no arucos
+// For this we assume the following:
+//   Arucos are rectangular or square shaped
+//   Arucos are of small
+//   Arucos have at least one child contour
+//
+// The checks are made from the cheapest to the most expensive, so that
+// the many contours of a busy background are dropped before the polygon
+// approximation: the number of points and the hierarchy, which cost
+// nothing, then the bounding box and the area, which go over the
+// points once. Only the survivors are approximated and must then have 4
+// convex vertices, sides of similar length and a black border.
+// The contours removed by each check are added to the counters
+//
+// The frame may be the camera frame halved level times. The limits are
+// scaled accordingly and the markers are returned in full resolution
+// coordinates. The frame may also be a region of the camera frame
+// whose top left corner is at offset
+void detect_arucos(Mat &frame, vector<Aruco > &arucos, ContourScratch &scratch, int level, Point offset) {
+        TRACE_SCOPE("detect_arucos");
+        const int scale = 1 << level;
+        const double min_area = double(MIN_MARKER_AREA) / (scale * scale);
+        // Pixels of the reduced frame are coarser, so the same epsilon in
+        // full resolution pixels is a larger fraction of the perimeter
+        const double epsilon = APPROX_EPSILON * scale;
+
+        vector<vector<Point> > &contours = scratch.contours;
+        vector<Vec4i> &hierarchy = scratch.hierarchy;
+        vector<Point> &possible_marker = scratch.polygon;
+
+        // hierarchy has as many elements as contours there are
+        // hierarchy[i][0] is the index of the next contour at the same level
+        // hierarchy[i][1] is the index of the previous contour at the same level
+        // hierarchy[i][2] is the index of the children contour
+        // hierarchy[i][3] is the index of the parent contour
+        // If one index is -1 then that element does not exist
+        findContours(frame, contours, hierarchy, RETR_TREE, CHAIN_APPROX_SIMPLE);
+        RejectCounters &counters = scratch.counters;
+        counters.contours += contours.size();
+
+        for(size_t c = 0; c < contours.size(); ++c) {
+                // A quadrilateral has at least 4 points, even compressed
+                if (contours[c].size() < 4) {
+                        counters.rejected[REJECT_POINTS]++;
+                        continue;
+                }
+                if (hierarchy[c][2] != -1 && hierarchy[c][3] == -1) {
+                        counters.rejected[REJECT_HIERARCHY]++;
+                        continue;
+                }
+                // The box is never smaller than the contour
+                Rect box = boundingRect(contours[c]);
+                if (double(box.width) * box.height < min_area) {
+                        counters.rejected[REJECT_BOUNDS]++;
+                        continue;
+                }
+                if (contourArea(contours[c]) < min_area) {
+                        counters.rejected[REJECT_AREA]++;
+                        continue;
+                }
+
+                double perimeter = arcLength(contours[c], true);
+                approxPolyDP(contours[c], possible_marker, epsilon * perimeter, true);
+
+                // Discard shapes
+                if (possible_marker.size() != 4) {
+                        counters.rejected[REJECT_VERTICES]++;
+                        continue;
+                }
+                if (!isContourConvex(possible_marker)) {
+                        counters.rejected[REJECT_CONVEXITY]++;
+                        continue;
+                }
+
+                double shortest = DBL_MAX, longest = 0;
+                for(size_t v = 0; v < 4; ++v) {
+                        double side = norm(possible_marker[(v + 1) % 4] - possible_marker[v]);
+                        shortest = min(shortest, side);
+                        longest = max(longest, side);
+                }
+                if (shortest < MIN_SIDE_RATIO * longest) {
+                        counters.rejected[REJECT_ASPECT]++;
+                        continue;
+                }
+                if (!has_black_border(frame, possible_marker)) {
+                        counters.rejected[REJECT_BORDER]++;
+                        continue;
+                }
+                counters.candidates++;
+                
+                Aruco marker;
+
+                // A pixel of the reduced frame covers scale x scale pixels
+                // of the full one, its center is at (x + 0.5) * scale - 0.5
+                for(size_t v = 0; v < marker.vertex.size(); ++v) {
+                        marker.vertex[v] = Point2f((possible_marker[v].x + 0.5f) * scale - 0.5f + offset.x,
+                                                   (possible_marker[v].y + 0.5f) * scale - 0.5f + offset.y);
+                }
+                
+                Moments m = moments(contours[c], true);
+                marker.center = Point2f(double(m.m10 / m.m00 + 0.5) * scale - 0.5 + offset.x,
+                                        double(m.m01 / m.m00 + 0.5) * scale - 0.5 + offset.y);
+
+                // Push only markers that have been correctly identified
+                arucos.push_back(marker);
+        }
+}
+
+// Check that the inside of each side of a quadrilateral is black
+//
+// The middle of each side is moved BORDER_PROBE pixels towards the
+// center, where the border of a marker is black, so set in the
+// thresholded frame. The contours around the white cells of a marker,
+// or around any white patch, are white on the inside. Close to the
+// edges of the border the adaptive threshold is reliable even for large
+// markers, whose wide black cells are white in their middle.
+// One side may fail, to allow for glare and for noise in the threshold.
+// Only zero and non zero are told apart, which findContours keeps even
+// in the versions of OpenCV that label the pixels of its input
+bool has_black_border(const Mat &bw, const vector<Point> &polygon) {
+        Point2f center(0, 0);
+        for(auto &p : polygon) center += Point2f(p);
+        center *= 1.0f / polygon.size();
+
+        int black_sides = 0;
+        for(size_t v = 0; v < polygon.size(); ++v) {
+                Point2f middle = (Point2f(polygon[v]) + Point2f(polygon[(v + 1) % polygon.size()])) * 0.5f;
+                Point2f inwards = center - middle;
+                double length = norm(inwards);
+                if (length < BORDER_PROBE) continue;
+
+                Point probe(cvRound(middle.x + inwards.x * BORDER_PROBE / length),
+                            cvRound(middle.y + inwards.y * BORDER_PROBE / length));
+                if (probe.x >= 0 && probe.y >= 0 && probe.x < bw.cols && probe.y < bw.rows
+                        && bw.at<uint8_t>(probe.y, probe.x) != 0)
+                        black_sides++;
+        }
+        return black_sides + 1 >= int(polygon.size());
+}
+
+// Keep a single candidate of each marker
+//
+// The outer and inner edges of the black border of a marker are both
+// contours, so a marker may give several nested quadrilaterals with
+// about the same center. They would be decoded, located and drawn once
+// each. Of the candidates from first on whose centers are closer than
+// DUPLICATE_DISTANCE times the side of the smallest one only the
+// largest is kept, which is the outer edge of the border.
+//
+// The candidates are visited from the largest to the smallest and the
+// kept ones are put in a spatial hash of their centers, with cells as
+// large as the largest distance allowed. A candidate is only compared
+// with those of its cell and the 8 around it, so the cost is linear in
+// the number of candidates. The order of the kept candidates is kept
+void suppress_duplicates(vector<Aruco> &arucos, ContourScratch &scratch, size_t first) {
+        TRACE_SCOPE("suppress_duplicates");
+        if (arucos.size() < first + 2) return;
+        const int n = int(arucos.size() - first);
+
+        vector<float> &areas = scratch.areas;
+        vector<int> &order = scratch.order;
+        vector<int> &heads = scratch.heads;
+        vector<int> &next = scratch.next;
+        vector<uint8_t> &keep = scratch.keep;
+
+        areas.resize(n);
+        order.resize(n);
+        float radius = 1;
+        for(int i = 0; i < n; ++i) {
+                const array<Point2f, 4> &v = arucos[first + i].vertex;
+                float area = 0;
+                for(size_t k = 0; k < v.size(); ++k) {
+                        area += v[k].x * v[(k + 1) % 4].y - v[(k + 1) % 4].x * v[k].y;
+                }
+                areas[i] = fabs(area) * 0.5f;
+                order[i] = i;
+                radius = max(radius, float(DUPLICATE_DISTANCE * sqrt(areas[i])));
+        }
+        sort(order.begin(), order.end(), [&](int a, int b) { return areas[a] > areas[b]; });
+
+        // Power of two with at least twice as many buckets as candidates
+        int buckets = 1;
+        while (buckets < 2 * n) buckets <<= 1;
+        heads.assign(buckets, -1);
+        next.resize(n);
+        keep.assign(n, 0);
+
+        const float cell = radius;
+        auto bucket = [&](int cx, int cy) {
+                return int((uint32_t(cx) * 73856093u ^ uint32_t(cy) * 19349663u) & uint32_t(buckets - 1));
+        };
+
+        for(int i : order) {
+                Point2f center(arucos[first + i].center);
+                int cx = int(floor(center.x / cell));
+                int cy = int(floor(center.y / cell));
+                // The candidates seen before are larger, so the distance
+                // is relative to this one
+                float limit = float(DUPLICATE_DISTANCE * sqrt(areas[i]));
+
+                bool duplicate = false;
+                for(int dy = -1; dy <= 1 && !duplicate; ++dy) {
+                        for(int dx = -1; dx <= 1 && !duplicate; ++dx) {
+                                for(int k = heads[bucket(cx + dx, cy + dy)]; k != -1; k = next[k]) {
+                                        Point2f d = Point2f(arucos[first + k].center) - center;
+                                        if (d.x * d.x + d.y * d.y <= limit * limit) {
+                                                duplicate = true;
+                                                break;
+                                        }
+                                }
+                        }
+                }
+                if (duplicate) continue;
+
+                int b = bucket(cx, cy);
+                next[i] = heads[b];
+                heads[b] = i;
+                keep[i] = 1;
+        }
+
+        size_t out = first;
+        for(int i = 0; i < n; ++i) {
+                if (!keep[i]) continue;
+                if (out != first + i) arucos[out] = arucos[first + i];
+                ++out;
+        }
+        scratch.counters.duplicates += arucos.size() - out;
+        arucos.resize(out);
+}
+
+// Add the counters of a contour filter to a total
+void add_reject_counters(RejectCounters &total, const RejectCounters &counters) {
+        total.contours += counters.contours;
+        for(int s = 0; s < REJECT_STAGES; ++s) total.rejected[s] += counters.rejected[s];
+        total.candidates += counters.candidates;
+        total.duplicates += counters.duplicates;
+}
+
+// Print how many contours each stage of the filter removed
+void print_reject_counters(ostream &os, const RejectCounters &counters) {
+        os << "Contour filter: " << counters.contours << " contours, " << counters.candidates << " candidates" << endl;
+        for(int s = 0; s < REJECT_STAGES; ++s) {
+                os << "  " << reject_stage_name(s) << ": " << counters.rejected[s] << " removed" << endl;
+        }
+        os << "  duplicates: " << counters.duplicates << " removed" << endl;
+}
+
+// Name of a stage of the contour filter
+const char *reject_stage_name(int stage) {
+        const char *names[REJECT_STAGES] = {
+                "points", "hierarchy", "bounds", "area", "vertices", "convexity", "aspect", "border"
+        };
+        return stage >= 0 && stage < REJECT_STAGES ? names[stage] : "";
+}
+
+// Read the id of every possible marker of the frame
+void decode_markers(Frame &frame, const DecodingTable &decoding_table) {
+        TRACE_SCOPE("decode_markers");
+        for(auto &aruco: frame.arucos) {
+                MarkerCode code = read_marker_dictionary(frame.gray, aruco, decoding_table);
+                aruco.id = code.id;
+                aruco.rotation = code.rotation;
+                aruco.distance = code.distance;
+        }
+}
+
+// Refine the vertex of the markers found in a reduced frame
+//
+// The vertex are only accurate to a pixel of the reduced frame, so they
+// are searched again with subpixel accuracy in the full resolution gray
+// frame, in a window of about that size
+void refine_corners(const Mat &gray, vector<Aruco> &arucos, int level) {
+        TRACE_SCOPE("refine_corners");
+        const int half_window = max(2, 1 << level);
+
+        for(auto &aruco : arucos) {
+                cornerSubPix(gray, Mat(4, 1, CV_32FC2, aruco.vertex.data()), Size(half_window, half_window), Size(-1, -1),
+                        TermCriteria(TermCriteria::EPS + TermCriteria::MAX_ITER, 10, 0.01));
+        }
+}
+
+// Given a vector or Aruco markers draw them on the frame
+//
+// Draw the ID of the marker at its center, the border of the
+// marker and its shape above it
+// The points of the shape of every marker, taken from SHAPE_MODELS, are
+// moved into the coordinates of the camera with the pose of their
+// marker and projected into the frame together with a single call to
+// projectPoints. The edges are then drawn between the projections
+void draw_arucos(Mat &frame, vector<Aruco> &arucos, Shape current_shape, const Camera &camera, DrawScratch &scratch) {
+        
+        if(arucos.size() == 0) return;
+        TRACE_SCOPE("draw_arucos");
+
+        const double size = camera.marker_size;
+        vector<Point3d> &points = scratch.points;
+        vector<Point2d> &projected = scratch.projected;
+
+        points.clear();
+        for(auto &aruco: arucos) {
+                if (aruco.id == -1) continue;
+
+                // Draw the figure of the given marker
+                // aruco.shape = ARUCO_LUT.at(aruco.id);
+                aruco.shape = current_shape;
+                const ShapeModel &model = SHAPE_MODELS[int(aruco.shape)];
+
+                Matx33d r;
+                Rodrigues(aruco.rvec, r);
+                for(int p = 0; p < model.num_points; ++p) {
+                        double x = model.points[p][0] * size, y = model.points[p][1] * size, z = model.points[p][2] * size;
+                        points.push_back(Point3d(r(0, 0) * x + r(0, 1) * y + r(0, 2) * z + aruco.tvec[0],
+                                                 r(1, 0) * x + r(1, 1) * y + r(1, 2) * z + aruco.tvec[1],
+                                                 r(2, 0) * x + r(2, 1) * y + r(2, 2) * z + aruco.tvec[2]));
+                }
+        }
+
+        if (!points.empty()) {
+                projected.resize(points.size());
+                projectPoints(Mat(int(points.size()), 1, CV_64FC3, points.data()), Vec3d(0, 0, 0), Vec3d(0, 0, 0),
+                        camera.camMatrix, camera.distCoeffs, Mat(int(projected.size()), 1, CV_64FC2, projected.data()));
+        }
+
+        size_t first = 0;
+        for(auto &aruco: arucos) {
+                if (aruco.id == -1) continue;
+
+                // Draw the first border vertex
+                aruco.first_vertex = aruco.vertex[aruco.rotation];
+                circle(frame, aruco.first_vertex, 8, Scalar(0, 0, 255), 2);
+                
+                // Draw id at the center of the marker. The label of an
+                // id never changes, so its text is only built once
+                if (size_t(aruco.id) >= scratch.labels.size())
+                        scratch.labels.resize(aruco.id + 1);
+                TextOverlay &label = scratch.labels[aruco.id];
+                if (label.image.empty())
+                        draw_text(frame, label, "id=" + to_string(aruco.id), aruco.center, 0.7, Scalar(0, 0, 255));
+                else
+                        draw_text(frame, label, label.text, aruco.center, 0.7, Scalar(0, 0, 255));
+
+                // Draw the border of the marker
+                draw_square(frame, aruco.vertex.data(), Scalar(0, 255, 0));
+
+                const ShapeModel &model = SHAPE_MODELS[int(aruco.shape)];
+                for(int e = 0; e < model.num_edges; ++e) {
+                        line(frame, projected[first + model.edges[e][0]], projected[first + model.edges[e][1]],
+                                Scalar(0, 255, 255), 2);
+                }
+                first += model.num_points;
+        }
+}
+
+// Draw a text on a BGR frame with its baseline starting at origin
+//
+// The overlay is rendered again only if the text is not the one it has.
+// The part of the text outside of the frame is left out
+void draw_text(Mat &frame, TextOverlay &overlay, const string &text, Point origin, double scale, Scalar color) {
+        if (overlay.image.empty() || text != overlay.text) {
+                int baseline = 0;
+                Size size = getTextSize(text, FONT_HERSHEY_SIMPLEX, scale, 1, &baseline);
+
+                overlay.text = text;
+                overlay.ascent = size.height + 1;
+                overlay.image.create(size.height + baseline + 2, size.width + 2, CV_8UC3);
+                overlay.image.setTo(Scalar::all(0));
+                putText(overlay.image, text, Point(1, overlay.ascent), FONT_HERSHEY_SIMPLEX, scale, color, 1, CV_AA);
+                cvtColor(overlay.image, overlay.mask, CV_BGR2GRAY);
+        }
+
+        Rect area(origin.x - 1, origin.y - overlay.ascent, overlay.image.cols, overlay.image.rows);
+        Rect visible = area & Rect(0, 0, frame.cols, frame.rows);
+        if (visible.empty()) return;
+
+        Rect source(visible.x - area.x, visible.y - area.y, visible.width, visible.height);
+        overlay.image(source).copyTo(frame(visible), overlay.mask(source));
+}
+
+// Given a gray frame and the vertex of an aruco extract the data of the marker
+//
+// The code of the marker is looked up in the decoding table
+// Return the id of the aruco if it is found
+// Return -1 as the id otherwise
+MarkerCode read_marker_dictionary(const Mat &gray, const Aruco &aruco, const DecodingTable &decoding_table) {
+        TRACE_SCOPE("read_marker_dictionary");
+        uint64_t code;
+        if (!read_marker_code(gray, aruco, decoding_table.bits, code)) return MarkerCode{-1, 0, 0};
+
+        return lookup_marker(decoding_table, code);
+}
+
+// Read the code of the inner cells of a marker
+//
+// Instead of warping the marker into a flat image, only the cells are
+// read. A few points of each cell are mapped into the frame through the
+// homography of the marker and averaged. The cells are then split into
+// black and white with Otsu and the inner cells are packed into a code,
+// the cell at row c and column r in bit c * bits + r.
+// Return false if the marker falls outside of the frame or has no contrast
+bool read_marker_code(const Mat &gray, const Aruco &aruco, int bits, uint64_t &code) {
+        const int n = bits + 2;
+
+        // Homography from the cells of the marker to the frame
+        Matx33d h;
+        if (!cell_homography(aruco.vertex, n, h)) return false;
+
+        // Mean intensity of each cell
+        float cells[MAX_MARKER_BITS + 2][MAX_MARKER_BITS + 2];
+        float darkest = 255, brightest = 0;
+
+        for(int c = 0; c < n; ++c) {
+                for(int r = 0; r < n; ++r) {
+                        int sum = 0;
+
+                        for(int sy = 0; sy < CELL_SAMPLES; ++sy) {
+                                for(int sx = 0; sx < CELL_SAMPLES; ++sx) {
+                                        double x = r + CELL_SAMPLE_OFFSETS[sx];
+                                        double y = c + CELL_SAMPLE_OFFSETS[sy];
+
+                                        double w = h(2, 0) * x + h(2, 1) * y + h(2, 2);
+                                        int px = cvRound((h(0, 0) * x + h(0, 1) * y + h(0, 2)) / w);
+                                        int py = cvRound((h(1, 0) * x + h(1, 1) * y + h(1, 2)) / w);
+
+                                        if (px < 0 || py < 0 || px >= gray.cols || py >= gray.rows)
+                                                return false;
+
+                                        sum += gray.at<uint8_t>(py, px);
+                                }
+                        }
+
+                        cells[c][r] = float(sum) / (CELL_SAMPLES * CELL_SAMPLES);
+                        darkest = min(darkest, cells[c][r]);
+                        brightest = max(brightest, cells[c][r]);
+                }
+        }
+
+        // A flat patch has no code to read
+        if (brightest - darkest < MIN_CELL_CONTRAST) return false;
+
+        float sorted_cells[(MAX_MARKER_BITS + 2) * (MAX_MARKER_BITS + 2)];
+        for(int c = 0; c < n; ++c) {
+                copy(cells[c], cells[c] + n, sorted_cells + c * n);
+        }
+        float thresh = otsu_threshold(sorted_cells, n * n);
+
+        code = 0;
+        
+        for(int c = 0; c < bits; ++c) {
+                for(int r = 0; r < bits; ++r) {
+                        if(cells[c+1][r+1] > thresh)
+                                code |= uint64_t(1) << (c * bits + r);
+                }
+        }
+
+        return true;
+}
+
+// Homography from the cells of a marker to the frame
+//
+// Closed form of the mapping of the unit square onto a quadrilateral
+// (Heckbert, Fundamentals of Texture Mapping and Image Warping), scaled
+// to the n x n cells of the marker. Unlike getPerspectiveTransform it solves no linear
+// system and allocates nothing.
+// Return false if the vertex are degenerate
+bool cell_homography(const array<Point2f, 4> &vertex, int n, Matx33d &h) {
+        TRACE_SCOPE("cell_homography");
+
+        // Cell (0, 0), (n, 0), (n, n) and (0, n), see MARKER_CELL_VERTEX
+        const Point2f &p0 = vertex[1], &p1 = vertex[0], &p2 = vertex[3], &p3 = vertex[2];
+
+        double sx = p0.x - p1.x + p2.x - p3.x;
+        double sy = p0.y - p1.y + p2.y - p3.y;
+        double dx1 = p1.x - p2.x, dx2 = p3.x - p2.x;
+        double dy1 = p1.y - p2.y, dy2 = p3.y - p2.y;
+
+        double den = dx1 * dy2 - dx2 * dy1;
+        if (den == 0) return false;
+
+        double g = (sx * dy2 - dx2 * sy) / den;
+        double k = (dx1 * sy - sx * dy1) / den;
+
+        h = Matx33d((p1.x - p0.x + g * p1.x) / n, (p3.x - p0.x + k * p3.x) / n, p0.x,
+                    (p1.y - p0.y + g * p1.y) / n, (p3.y - p0.y + k * p3.y) / n, p0.y,
+                    g / n,                         k / n,                         1);
+        return true;
+}
+
+// Otsu's method over a small set of values
+//
+// The values are sorted in place.
+// Return the value that splits them in the two groups with the
+// largest variance between them
+float otsu_threshold(float *values, int n) {
+        float *sorted = values;
+        sort(sorted, sorted + n);
+
+        float total = 0;
+        for(int k = 0; k < n; ++k) total += sorted[k];
+
+        float best_thresh = sorted[0];
+        float best_variance = -1;
+        float sum_low = 0;
+
+        for(int k = 1; k < n; ++k) {
+                sum_low += sorted[k - 1];
+
+                float mean_low = sum_low / k;
+                float mean_high = (total - sum_low) / (n - k);
+                float variance = float(k) * (n - k) * (mean_low - mean_high) * (mean_low - mean_high);
+
+                if (variance > best_variance) {
+                        best_variance = variance;
+                        best_thresh = (sorted[k - 1] + sorted[k]) / 2;
+                }
+        }
+        return best_thresh;
+}
+
+// Build the index of the dictionary compiled into the detector
+void build_decoding_table(DecodingTable &decoding_table, int max_distance) {
+        build_decoding_table(decoding_table, DICT_CODES, DICT_NUM_MARKERS, DICT_MARKER_BITS, max_distance);
+}
+
+// Load the dictionary file filename, or use the compiled one if the
+// name is empty
+//
+// Raise an error if the file is not a valid dictionary
+void load_decoding_table(DecodingTable &decoding_table, const string &filename, int max_distance) {
+        if (filename.empty()) {
+                build_decoding_table(decoding_table, max_distance);
+                return;
+        }
+
+        if (!load_dictionary(filename, decoding_table, max_distance))
+                CV_Error(Error::StsBadArg, "Cannot load the dictionary " + filename);
+}
+
+// Given 4 vertex, draw a square with them
+template<class V>
+void draw_square(Mat &frame, const V *v, Scalar color, int thickness) {
+        for(size_t l = 0; l < 4; ++l) {
+                line(frame, v[l], v[(l + 1) %4], color, thickness);
+        }
+}
+
+// Write the markers of a frame as a line of JSON
+//
+// {"frame": 0, "markers": [{"id": 3, "corners": [[x, y], ...], "rvec": [x, y, z], "tvec": [x, y, z]}]}
+// Markers that could not be identified are skipped
+void write_detections(ostream &os, const Frame &frame) {
+        os << "{\"frame\": " << frame.index << ", \"markers\": [";
+
+        bool first = true;
+        for(auto &aruco : frame.arucos) {
+                if (aruco.id == -1) continue;
+
+                if (!first) os << ", ";
+                first = false;
+
+                os << "{\"id\": " << aruco.id << ", \"corners\": [";
+                for(size_t v = 0; v < aruco.vertex.size(); ++v) {
+                        os << (v ? ", " : "") << "[" << aruco.vertex[v].x << ", " << aruco.vertex[v].y << "]";
+                }
+                os << "], \"rvec\": [" << aruco.rvec[0] << ", " << aruco.rvec[1] << ", " << aruco.rvec[2] << "]"
+                   << ", \"tvec\": [" << aruco.tvec[0] << ", " << aruco.tvec[1] << ", " << aruco.tvec[2] << "]}";
+        }
+        os << "]}\n";
+}
+
+// Fill the record of a frame published to a ring
+//
+// Markers that could not be identified are skipped. Past
+// RECORD_MAX_MARKERS they are only counted in total
+void detection_record(const Frame &frame, DetectionRecord &record) {
+        record.frame = frame.index;
+        record.timestamp_ns = capture_timestamp_ns(frame);
+        record.count = 0;
+        record.total = 0;
+
+        for(auto &aruco : frame.arucos) {
+                if (aruco.id == -1) continue;
+
+                record.total++;
+                if (record.count < RECORD_MAX_MARKERS)
+                        marker_record(aruco, record.markers[record.count++]);
+        }
+}
+
+// Append the identified markers of a frame to a detection log
+void log_detections(DetectionLogWriter &log, const Frame &frame) {
+        int64_t timestamp_ns = capture_timestamp_ns(frame);
+        MarkerRecord marker;
+
+        for(auto &aruco : frame.arucos) {
+                if (aruco.id == -1) continue;
+
+                marker_record(aruco, marker);
+                log.append(frame.index, timestamp_ns, marker);
+        }
+}
+
+// Id, corners and pose of a marker as they are published and logged
+void marker_record(const Aruco &aruco, MarkerRecord &marker) {
+        marker.id = aruco.id;
+        marker.distance = aruco.distance;
+        for(size_t v = 0; v < aruco.vertex.size(); ++v) {
+                marker.corners[v][0] = aruco.vertex[v].x;
+                marker.corners[v][1] = aruco.vertex[v].y;
+        }
+        for(int k = 0; k < 3; ++k) {
+                marker.rvec[k] = aruco.rvec[k];
+                marker.tvec[k] = aruco.tvec[k];
+        }
+}
+
+// When a frame was captured, in nanoseconds of the system clock
+//
+// The frames are timed with the high resolution clock, which may not
+// count from the epoch, so its age is taken from the system clock
+int64_t capture_timestamp_ns(const Frame &frame) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()
+                - (std::chrono::high_resolution_clock::now() - frame.captured)).count();
+}
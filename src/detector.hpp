@@ -0,0 +1,288 @@
+#ifndef _DETECTOR_H
+#define _DETECTOR_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <chrono>
+#include <ostream>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+#include "aruco.hpp"
+#include "threshold.hpp"
+#include "latency.hpp"
+#include "dictionary.hpp"
+#include "decoding_table.hpp"
+#include "shm_ring.hpp"
+#include "detection_log.hpp"
+#include "square_pose.hpp"
+
+// Smallest area of a marker, in pixels of the full resolution frame
+#define MIN_MARKER_AREA 500
+// Tolerance of the polygon approximation relative to the contour perimeter
+#define APPROX_EPSILON 0.005
+// Smallest ratio between the shortest and the longest side of a marker
+#define MIN_SIDE_RATIO 0.1
+// Distance from the sides of a marker at which its black border is
+// checked, in pixels of the frame the contours are searched in
+#define BORDER_PROBE 2
+// Largest distance between the centers of two candidates of the same
+// marker, relative to the side of the smallest one
+#define DUPLICATE_DISTANCE 0.25
+
+// Cells per side of a marker, including the black border
+#define MARKER_CELLS (DICT_MARKER_BITS + 2)
+
+// Smallest margin around the predicted position of a tracked marker
+#define TRACK_MIN_MARGIN 16
+
+// Samples taken along each side of a cell when reading a marker
+#define CELL_SAMPLES 3
+// Minimum difference between the darkest and brightest cells of a marker
+#define MIN_CELL_CONTRAST 20
+
+// Height of the shapes drawn over the markers relative to their side
+#define CUBE_HEIGHT 1.0
+#define PYRAMID_HEIGHT 1.44
+#define PYRAMID_SIDE_HEIGHT 0.48
+// Most points and edges of a shape drawn over a marker
+#define SHAPE_MAX_POINTS 8
+#define SHAPE_MAX_EDGES 8
+
+using namespace cv;
+using namespace std;
+
+// Frame travelling through the pipeline
+//
+// Frames are taken from a FramePool so the images keep their buffers
+// between iterations. The index is the position of the frame in the
+// stream and is used to restore the order after the parallel stages.
+// decoded is set when the markers were already read, and their pose
+// computed, by the detection stage.
+// The image is BGR or gray. A gray image is also the gray frame, which
+// then shares its buffer instead of being converted. In gray capture the
+// decoder writes into raw and the image is its luma plane.
+// The markers are in the coordinates of the image as captured. mirror
+// only flips the annotated copy, which is BGR and is only made when the
+// frame is shown or written.
+// captured is when the frame was read. The times are how long
+// find_markers spent preprocessing it and looking for the contours, and
+// how long the Detector spent decoding it and computing the poses
+struct Frame {
+        uint64_t index;
+        Mat raw;
+        Mat image;
+        Mat gray;
+        Mat bw;
+        Mat annotated;
+        vector<Aruco> arucos;
+        bool mirror;
+        bool decoded;
+        std::chrono::high_resolution_clock::time_point captured;
+        int64_t preprocess_ns;
+        int64_t contours_ns;
+        int64_t decode_ns;
+        int64_t pose_ns;
+};
+
+// Stages of the contour filter of detect_arucos, cheapest first
+enum RejectStage {
+        REJECT_POINTS = 0,
+        REJECT_HIERARCHY,
+        REJECT_BOUNDS,
+        REJECT_AREA,
+        REJECT_VERTICES,
+        REJECT_CONVEXITY,
+        REJECT_ASPECT,
+        REJECT_BORDER,
+        REJECT_STAGES
+};
+
+// Number of contours seen, removed by each stage and kept as candidates,
+// and number of candidates removed as duplicates of another one
+struct RejectCounters {
+        uint64_t contours;
+        uint64_t rejected[REJECT_STAGES];
+        uint64_t candidates;
+        uint64_t duplicates;
+
+        RejectCounters() : contours(0), rejected(), candidates(0), duplicates(0) {}
+};
+
+// Buffers of detect_arucos and suppress_duplicates reused between
+// frames, and their counters
+//
+// The spatial hash of suppress_duplicates is a table of chains: heads
+// has the first candidate of each bucket and next the following one
+struct ContourScratch {
+        vector<vector<Point> > contours;
+        vector<Vec4i> hierarchy;
+        vector<Point> polygon;
+        vector<float> areas;
+        vector<int> order;
+        vector<int> heads;
+        vector<int> next;
+        vector<uint8_t> keep;
+        RejectCounters counters;
+};
+
+// Buffers of estimate_poses reused between frames
+//
+// The corners of every marker of a frame, in pixels and undistorted,
+// and both of their poses
+struct PoseScratch {
+        vector<Point2f> corners;
+        vector<Point2f> normalized;
+        vector<SquarePoses> poses;
+};
+
+// Text drawn on the frames, rendered only when it changes
+//
+// putText allocates on every call, so the text is drawn once into an
+// image of its own and then copied onto the frames through its mask.
+// ascent is the height of the image above the baseline of the text
+struct TextOverlay {
+        string text;
+        Mat image;
+        Mat mask;
+        int ascent;
+};
+
+// Buffers of draw_arucos reused between frames
+//
+// The points of the shapes of every marker of a frame, in the
+// coordinates of the camera, and their projection into the frame.
+// labels has the label of each id
+struct DrawScratch {
+        vector<Point3d> points;
+        vector<Point2d> projected;
+        vector<TextOverlay> labels;
+};
+
+// Buffers owned by a detection thread and reused between frames
+//
+// Once they have grown to fit the frames the detection does not allocate
+struct DetectScratch {
+        ThresholdScratch threshold;
+        ContourScratch contours;
+        PoseScratch pose;
+        Mat small_gray;
+        Mat small_bw;
+        vector<Aruco> candidates;
+};
+
+// Marker followed between frames
+//
+// The velocity is the displacement of its center since the previous frame
+struct Track {
+        Aruco marker;
+        Point2f velocity;
+};
+
+// State of the tracking between frames
+//
+// The whole frame is scanned every scan_interval frames. In between only
+// the regions around the predicted position of the tracks are searched.
+// updated is swapped with tracks on every frame to reuse its buffer
+struct Tracker {
+        vector<Track> tracks;
+        vector<Track> updated;
+        int scan_interval;
+        int frames_since_scan;
+};
+
+// Intrinsics of the camera and side of the markers
+//
+// The translation of the markers is given in the units of marker_size
+struct Camera {
+        Mat camMatrix;
+        Mat distCoeffs;
+        double marker_size;
+};
+
+// Options of a Detector
+//
+// With a track_interval the markers are tracked between the frames and
+// the whole frame is only scanned every track_interval frames.
+// dictionary is a file written by gen_dictionary, the dictionary
+// compiled into the detector is used if it is empty
+struct DetectorOptions {
+        int pyramid_level;
+        int tolerance;
+        int track_interval;
+        bool with_pose;
+        string dictionary;
+
+        DetectorOptions() : pyramid_level(0), tolerance(1), track_interval(0), with_pose(true) {}
+};
+
+// Find, identify and locate the markers of a sequence of frames
+//
+// The detector owns every buffer it needs, so once they have grown to
+// fit the frames no more memory is allocated. The frames are read in
+// place from the buffer of the caller, which must be 8 bit gray or BGR.
+// A detector is used by one thread at a time. With tracking, the frames
+// must be given in order
+class Detector {
+public:
+        Detector(const Camera &camera, const DetectorOptions &options = DetectorOptions());
+        // Detector sharing a table already loaded
+        Detector(const Camera &camera, const DecodingTable &decoding_table, const DetectorOptions &options = DetectorOptions());
+
+        // Markers identified in the image of size width x height, with
+        // step bytes per row. They are valid until the next call
+        const vector<Aruco> &detect(const uint8_t *data, size_t step, int width, int height, int channels);
+        const vector<Aruco> &detect(const Mat &image);
+
+        // Fill frame.arucos with the markers of frame.image
+        void detect_frame(Frame &frame);
+
+        const DecodingTable &table() const { return decoding_table; }
+        const RejectCounters &reject_counters() const { return scratch.contours.counters; }
+
+private:
+        Camera camera;
+        DetectorOptions options;
+        DecodingTable decoding_table;
+        Tracker tracker;
+        DetectScratch scratch;
+        Frame input;
+        vector<Aruco> markers;
+};
+
+void calibrate_camera(String filename, Mat &camMatrix, Mat &distCoeffs);
+void prepare_frame(Frame &frame);
+bool luma_plane(const Mat &raw, int fourcc, Size size, Mat &gray);
+void find_markers(Frame &frame, int pyramid_level, DetectScratch &scratch);
+void decode_markers(Frame &frame, const DecodingTable &decoding_table);
+bool track_markers(Frame &frame, const Tracker &tracker, const DecodingTable &decoding_table, DetectScratch &scratch);
+void update_tracks(Tracker &tracker, const vector<Aruco> &arucos);
+const Track *find_track(const Tracker &tracker, const Aruco &aruco);
+void estimate_poses(Frame &frame, const Camera &camera, const Tracker *tracker, PoseScratch &scratch);
+void estimate_poses(vector<Aruco> &arucos, const Camera &camera, const Tracker *tracker, PoseScratch &scratch);
+void marker_model_corners(const Aruco &aruco, array<Point2f, 4> &corners);
+void detect_arucos(Mat &frame, vector<Aruco> &arucos, ContourScratch &scratch, int level = 0, Point offset = Point());
+bool has_black_border(const Mat &bw, const vector<Point> &polygon);
+void suppress_duplicates(vector<Aruco> &arucos, ContourScratch &scratch, size_t first = 0);
+void add_reject_counters(RejectCounters &total, const RejectCounters &counters);
+void print_reject_counters(ostream &os, const RejectCounters &counters);
+const char *reject_stage_name(int stage);
+void refine_corners(const Mat &gray, vector<Aruco> &arucos, int level);
+void draw_arucos(Mat &frame, vector<Aruco> &arucos, Shape current_shape, const Camera &camera, DrawScratch &scratch);
+void draw_text(Mat &frame, TextOverlay &overlay, const string &text, Point origin, double scale, Scalar color);
+MarkerCode read_marker_dictionary(const Mat &gray, const Aruco &aruco, const DecodingTable &decoding_table);
+bool read_marker_code(const Mat &gray, const Aruco &aruco, int bits, uint64_t &code);
+bool cell_homography(const array<Point2f, 4> &vertex, int n, Matx33d &h);
+float otsu_threshold(float *values, int n);
+void build_decoding_table(DecodingTable &decoding_table, int max_distance);
+void load_decoding_table(DecodingTable &decoding_table, const string &filename, int max_distance);
+void write_detections(ostream &os, const Frame &frame);
+void detection_record(const Frame &frame, DetectionRecord &record);
+void log_detections(DetectionLogWriter &log, const Frame &frame);
+void marker_record(const Aruco &aruco, MarkerRecord &marker);
+int64_t capture_timestamp_ns(const Frame &frame);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Every power of two is split into 2^LATENCY_SUB_BITS buckets, so a
+// percentile is never off by more than 1/16 of its value
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+// Longest latency that can be told apart, 2^40 ns is about 18 minutes
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// Nanoseconds elapsed since start
+inline int64_t elapsed_ns(std::chrono::high_resolution_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Histogram of latencies in nanoseconds
+//
+// The buckets grow with the value like the exponent and mantissa of a
+// floating point number. Values below LATENCY_SUB_BUCKETS have a bucket
+// each, above that every power of two has LATENCY_SUB_BUCKETS buckets.
+// Every counter is atomic, so any thread can record samples without a
+// lock while another one reads the percentiles
+class LatencyHistogram {
+public:
+        LatencyHistogram() : samples(0), sum(0), maximum(0) {
+                for(auto &b : buckets) b.store(0, std::memory_order_relaxed);
+        }
+
+        void record(int64_t ns) {
+                uint64_t v = ns < 0 ? 0 : uint64_t(ns);
+
+                buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+                samples.fetch_add(1, std::memory_order_relaxed);
+                sum.fetch_add(v, std::memory_order_relaxed);
+
+                uint64_t current = maximum.load(std::memory_order_relaxed);
+                while (v > current && !maximum.compare_exchange_weak(current, v, std::memory_order_relaxed)) {}
+        }
+
+        uint64_t count() const { return samples.load(std::memory_order_relaxed); }
+        uint64_t total_ns() const { return sum.load(std::memory_order_relaxed); }
+        uint64_t max_ns() const { return maximum.load(std::memory_order_relaxed); }
+
+        double mean_ns() const {
+                uint64_t n = count();
+                return n ? double(total_ns()) / n : 0;
+        }
+
+        // Smallest latency not exceeded by the fraction q of the samples
+        //
+        // Return the upper end of the bucket the percentile falls in
+        uint64_t percentile(double q) const {
+                uint64_t n = count();
+                if (n == 0) return 0;
+
+                uint64_t rank = uint64_t(q * n + 0.5);
+                if (rank < 1) rank = 1;
+
+                uint64_t seen = 0;
+                for(int b = 0; b < LATENCY_BUCKETS; ++b) {
+                        seen += buckets[b].load(std::memory_order_relaxed);
+                        if (seen >= rank) {
+                                uint64_t upper = bucket_upper(b);
+                                return upper < max_ns() ? upper : max_ns();
+                        }
+                }
+                return max_ns();
+        }
+
+        // Number of samples above ns, to the resolution of the buckets
+        uint64_t count_above(int64_t ns) const {
+                uint64_t above = 0;
+                for(int b = bucket(ns < 0 ? 0 : uint64_t(ns)) + 1; b < LATENCY_BUCKETS; ++b) {
+                        above += buckets[b].load(std::memory_order_relaxed);
+                }
+                return above;
+        }
+
+private:
+        static int bucket(uint64_t v) {
+                const uint64_t largest = (uint64_t(1) << LATENCY_MAX_BITS) - 1;
+                if (v > largest) v = largest;
+                if (v < LATENCY_SUB_BUCKETS) return int(v);
+
+                int shift = (63 - __builtin_clzll(v)) - LATENCY_SUB_BITS;
+                int mantissa = int(v >> shift);
+                return (shift + 1) * LATENCY_SUB_BUCKETS + mantissa - LATENCY_SUB_BUCKETS;
+        }
+
+        static uint64_t bucket_upper(int b) {
+                if (b < LATENCY_SUB_BUCKETS) return uint64_t(b);
+
+                int shift = b / LATENCY_SUB_BUCKETS - 1;
+                uint64_t mantissa = b % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+                return ((mantissa + 1) << shift) - 1;
+        }
+
+        std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+        std::atomic<uint64_t> samples;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> maximum;
+};
+
+#endif
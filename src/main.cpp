@@ -1,11 +1,16 @@
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <iterator>
 #include <chrono>
 #include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
 
 #include <opencv2/core/persistence.hpp>
 #include <opencv2/core/types.hpp>
@@ -19,24 +24,68 @@
 #include <opencv2/calib3d.hpp>
 
 #include "aruco.hpp"
+#include "detector.hpp"
+#include "pipeline.hpp"
+#include "alloc_counter.hpp"
+#include "latency.hpp"
+#include "trace.hpp"
+#include "video_output.hpp"
 
 #define ESC 27
 #define NUM_FRAMES 60
 
+// Frames processed before the allocations are counted, while the
+// buffers of the pipeline grow to their final size
+#define WARMUP_FRAMES 30
+
 #define CAMERA_WIN "Camera"
 
 using namespace cv;
 using namespace std;
 using namespace std::chrono;
 
-void calibrate_camera(String filename, Mat &camMatrix, Mat &distCoeffs);
-void detect_arucos(Mat &frame, vector<Aruco> &arucos);
-void draw_arucos(Mat &frame, vector<Aruco> &arucos, Shape current_shape, Mat &camMatrix, Mat &distCoeffs);
-char read_marker_dictionary(Mat &aruco_img);
-bool compare_matrixes(const uint8_t left_m[4][4], const uint8_t rigth_m[4][4]);
+typedef BoundedQueue<Frame *> FrameQueue;
 
-template<class V>
-void draw_square(Mat &frame, const vector<V> &v, Scalar color=Scalar(0, 255, 255), int thickness=2);
+// Latency of each stage, over all of its threads, and of the whole
+// pipeline from the capture of a frame until it is written out
+//
+// The detection is split into the preprocessing (gray and threshold)
+// and the contours. When tracking, the search around the tracks counts
+// as contours. video is the writer of the annotated video, which runs
+// apart from the pipeline
+struct StageTimes {
+        LatencyHistogram capture;
+        LatencyHistogram preprocess;
+        LatencyHistogram contours;
+        LatencyHistogram decode;
+        LatencyHistogram pose;
+        LatencyHistogram render;
+        LatencyHistogram display;
+        LatencyHistogram encode;
+        LatencyHistogram video;
+        LatencyHistogram total;
+};
+
+typedef pair<const char *, const LatencyHistogram *> StageLatency;
+
+void capture_frames(VideoCapture &stream, bool mirror, bool gray, FramePool<Frame> &pool, FrameQueue &out, atomic<bool> &running, StageTimes &times);
+void detect_frames(FrameQueue &in, FrameQueue &out, atomic<int> &active, int pyramid_level, Detector *tracker,
+        RejectCounters &rejects, mutex &rejects_mtx, StageTimes &times);
+void decode_frames(FrameQueue &in, FrameQueue &out, atomic<int> &active, const DecodingTable &decoding_table,
+        bool with_pose, const Camera &camera, StageTimes &times);
+void render_frames(FrameQueue &in, FrameQueue &out, size_t max_pending, bool draw, atomic<Shape> &current_shape, const Camera &camera,
+        DetectionPublisher *publisher, StageTimes &times);
+void encode_frames(FrameQueue &in, VideoOutput &video_output, ostream *detections, DetectionLogWriter *log,
+        FramePool<Frame> &pool, atomic<uint64_t> &frames_done, atomic<uint64_t> &warm_allocations, StageTimes &times);
+void display_frames(FrameQueue &in, FrameQueue &out, atomic<bool> &running, atomic<Shape> &current_shape, StageTimes &times);
+
+void add_time(LatencyHistogram &stage, high_resolution_clock::time_point start);
+vector<StageLatency> stage_latencies(const StageTimes &times);
+void print_stage_times(uint64_t frames, double seconds, const StageTimes &times, double deadline_ms);
+void print_latencies(ostream &os, const StageTimes &times);
+void report_latencies(atomic<bool> &reporting, int interval, const StageTimes &times);
+bool write_latencies(const String &filename, const StageTimes &times);
+double allocations_per_frame(uint64_t frames, uint64_t warm_allocations);
 
 int main(int argc, char **argv) {
 
@@ -44,9 +93,32 @@ int main(int argc, char **argv) {
         "{help h usage ? |          | Print this message      }"
         "{input          |<none>    | Video input file        }"
         "{c              |<none>    | Camera calibration file }"
-        "{out            |output.avi| Output video file }";
+        "{out            |          | Output video file or named pipe (output.avi unless headless) }"
+        "{out_format     |          | Format of the output video: mjpg, y4m, raw (BGR frames) or none (default from the extension) }"
+        "{out_drop       |          | Drop annotated frames of video files too when the writer falls behind (cameras always do) }"
+        "{out_depth      |8         | Annotated frames the writer may fall behind }"
+        "{record         |all       | Frames written to the output video: all or markers (only those with markers) }"
+        "{headless       |          | Process the input as fast as possible without a window }"
+        "{gray           |          | Capture only the luma of the frames and detect on it. BGR is only made to show or write the annotated video }"
+        "{detections     |          | Write the markers of every frame to this file as JSON lines }"
+        "{log            |          | Append the markers of every frame to this columnar detection log, read it with aruco_query }"
+        "{publish        |          | Publish the markers of every frame to a POSIX shared memory ring of this name, e.g. /aruco }"
+        "{publish_slots  |256       | Frames kept in the shared memory ring }"
+        "{pyramid        |0         | Look for markers in the frame halved this many times (0 = full resolution) }"
+        "{track          |0         | Track the markers and scan the whole frame only every this many frames (0 = no tracking) }"
+        "{tolerance      |1         | Number of wrong bits accepted when reading a marker }"
+        "{dictionary     |          | Dictionary file written by gen_dictionary (empty = the dictionary built in) }"
+        "{size           |1         | Side of the markers. The translation of the markers is given in the same units }"
+        "{depth          |4         | Number of frames queued between pipeline stages }"
+        "{workers        |0         | Threads per detection and decoding stage (0 = one per core) }"
+        "{max_allocations|-1        | Fail if the frames make more heap allocations than this on average once warmed up (-1 = no limit) }"
+        "{stats          |0         | Print the latency of each stage every this many seconds (0 = only at the end) }"
+        "{latency        |          | Write the latency percentiles of each stage to this file on exit (.csv or .json) }"
+        "{deadline       |0         | Count the frames that take longer than this many ms from capture to output }"
+        "{trace          |          | Write a timeline of the stages of every frame to this file (Chrome trace JSON, open it in Perfetto) }";
         
         CommandLineParser cmdParser(argc, argv, keys);
+        count_mat_allocations();
 
         if (cmdParser.has("help"))
         {
@@ -54,12 +126,13 @@ int main(int argc, char **argv) {
                 return 0;
         }
         // Current shape to draw. Cube by default
-        Shape current_shape = Shape::Cube;
-        // Camera matrix and distortion coefficients
-        Mat camMatrix, distCoeffs;
+        atomic<Shape> current_shape(Shape::Cube);
+        // Camera matrix, distortion coefficients and size of the markers
+        Camera camera;
+        camera.marker_size = cmdParser.get<double>("size");
         
         String fname = cmdParser.get<String>("c");
-        calibrate_camera(fname, camMatrix, distCoeffs);
+        calibrate_camera(fname, camera.camMatrix, camera.distCoeffs);
 
         String input_stream = cmdParser.get<String>("input");
         VideoCapture stream0;
@@ -69,407 +142,631 @@ int main(int argc, char **argv) {
         else
                 stream0 = cv::VideoCapture(input_stream);
 
+        // Ask for the frames as the camera or decoder gives them, the luma
+        // plane is then taken from them without any color conversion
+        bool gray_capture = cmdParser.has("gray");
+        if (gray_capture)
+                stream0.set(CV_CAP_PROP_CONVERT_RGB, 0);
+
+        // Without a window the annotated video is only written if requested
+        bool headless = cmdParser.has("headless");
+
         String output_file = cmdParser.get<String>("out");
+        if(output_file == "" && !headless)
+                output_file = "output.avi";
 
-        VideoWriter video_output(output_file, CV_FOURCC('M','J','P','G'), stream0.get(CV_CAP_PROP_FPS),
-                Size(stream0.get(CV_CAP_PROP_FRAME_WIDTH), stream0.get(CV_CAP_PROP_FRAME_HEIGHT)));
-        cout << "Writing result to video file: " << output_file << endl;
-        
         if (!stream0.isOpened()){
                 cout << "Cannot open stream" << endl;
                 return -1;
         }
 
-        Mat camera_frame, output_frame;
-        Mat camera_frame_gray, camera_frame_bw;
-        
-        // Image used to warp perspective and read the aruco dictionary
-        Mat aruco_flat_img(600, 600, CV_8UC3, Scalar(0, 0, 0));
-        
-        namedWindow(CAMERA_WIN, WINDOW_AUTOSIZE);
-
-        high_resolution_clock::time_point start_t, end_t;
-        float fps = 30.0;
-        int frame_counter = 0;
+        VideoOutputOptions video_options;
+        video_options.filename = output_file;
+        video_options.fps = stream0.get(CV_CAP_PROP_FPS);
+        video_options.size = Size(stream0.get(CV_CAP_PROP_FRAME_WIDTH), stream0.get(CV_CAP_PROP_FRAME_HEIGHT));
+        video_options.policy = input_stream == "" || cmdParser.has("out_drop") ? DropPolicy::Drop : DropPolicy::Block;
+        video_options.depth = max(1, cmdParser.get<int>("out_depth"));
 
-        bool running = true;
+        String record = cmdParser.get<String>("record");
+        if (record != "all" && record != "markers") {
+                cerr << "Unknown record mode \"" + record + "\"" << endl;
+                return -1;
+        }
+        video_options.only_markers = record == "markers";
 
-        vector<Point2f> aruco_flat_vertex;
+        String out_format = cmdParser.get<String>("out_format");
+        if (!parse_video_format(out_format, output_file, video_options.format)) {
+                cerr << "Unknown output format \"" + out_format + "\"" << endl;
+                return -1;
+        }
 
-        aruco_flat_vertex.push_back(Point2f(599,   0));
-        aruco_flat_vertex.push_back(Point2f(0,     0));
-        aruco_flat_vertex.push_back(Point2f(0,   599));
-        aruco_flat_vertex.push_back(Point2f(599, 599));
-                                
-        while(running) {
-                
-                if (!stream0.read(camera_frame)) {
-                        cout << "Failed to read camera frame" << endl;
+        ofstream detections_file;
+        String detections_name = cmdParser.get<String>("detections");
+        if(detections_name != "") {
+                detections_file.open(detections_name);
+                if(!detections_file.is_open()) {
+                        cerr << "Cannot open detections file \"" + detections_name + "\"" << endl;
                         return -1;
                 }
-                if(input_stream == "")
-                        flip(camera_frame, camera_frame, 1);
-                
-                // Estimation of the camera fps
-                // If working with a video file we can use stream.get(CV_CAP_PROP_FPS)
-                if(frame_counter == 0) {
-                        start_t = high_resolution_clock::now();
-                };
-                frame_counter++;
-                
-                // Convert the camera frame to gray scale
-                //
-                // Threshold the image to dectect the contours
-                //
-                // From all contours detected, discard the ones that are not Aruco markers
-                // Extract information about the aruco marker
-                // 
-                // Output the detected Aruco into the frame
-                
-                cvtColor(camera_frame, camera_frame_gray, CV_BGR2GRAY);
-
-                //
-                // Preprocess
-                //
-                adaptiveThreshold(camera_frame_gray, camera_frame_bw, 255,
-                        ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, 21, 7);
-
-                //
-                // Aruco detection
-                //
-                vector<Aruco> arucos;
-                
-                detect_arucos(camera_frame_bw, arucos);
-
-                for(auto &aruco: arucos) {                        
-                        Mat h = findHomography(aruco.vertex, aruco_flat_vertex);
-                        warpPerspective(camera_frame, aruco_flat_img, h, aruco_flat_img.size());
-                        aruco.id = read_marker_dictionary(aruco_flat_img);
+                cout << "Writing detections to: " << detections_name << endl;
+        }
+        ostream *detections = detections_file.is_open() ? &detections_file : nullptr;
+
+        DetectionLogWriter log;
+        String log_name = cmdParser.get<String>("log");
+        if(log_name != "") {
+                if(!log.open(log_name)) {
+                        cerr << "Cannot open detection log \"" + log_name + "\"" << endl;
+                        return -1;
                 }
+                cout << "Logging detections to: " << log_name << endl;
+        }
 
-                //
-                // Draw the arucos
-                //
-                draw_arucos(camera_frame, arucos, current_shape, camMatrix, distCoeffs);
-                
-                // Calculate the fps to check if the algorithm works in real time
-                if(frame_counter == NUM_FRAMES) {
-                        end_t = high_resolution_clock::now();
-                        duration<double, std::milli> time_span = end_t - start_t;
-                        fps = NUM_FRAMES * 1000 / (time_span.count());
-                        frame_counter = 0;
-                };
-
-                putText(camera_frame, "FPS: " + to_string(fps),
-                        cvPoint(15, 40), FONT_HERSHEY_SIMPLEX,
-                        0.8, cvScalar(0, 0, 255), 1, CV_AA);
-
-                putText(camera_frame, "Shape: " + to_string(current_shape),
-                        cvPoint(10, camera_frame.rows - 10),
-                        FONT_HERSHEY_SIMPLEX,
-                        0.6, cvScalar(0, 0, 255), 1, CV_AA);
-                
-                imshow(CAMERA_WIN, camera_frame);
-                video_output.write(camera_frame);
-                
-                // Handle key events
-                char key_pressed = waitKey(1);
-                switch(key_pressed) {
-                        case ESC:
-                        case 'q':
-                                running = false;
-                                break;
-                        case 'a':
-                                ++current_shape;
+        // Ring read by the local consumers of the markers
+        DetectionPublisher publisher;
+        String ring_name = cmdParser.get<String>("publish");
+        if(ring_name != "") {
+                if(!publisher.open(ring_name, max(1, cmdParser.get<int>("publish_slots")))) {
+                        cerr << "Cannot create the shared memory ring \"" + ring_name + "\"" << endl;
+                        return -1;
                 }
-                
+                cout << "Publishing detections to: " << ring_name << endl;
+        }
+
+        // Codes of the inner cells mapped to their marker
+        DecodingTable decoding_table;
+        load_decoding_table(decoding_table, cmdParser.get<String>("dictionary"), cmdParser.get<int>("tolerance"));
+
+        int depth = max(1, cmdParser.get<int>("depth"));
+        int pyramid_level = max(0, cmdParser.get<int>("pyramid"));
+        int workers = cmdParser.get<int>("workers");
+        if (workers <= 0)
+                workers = max(1u, thread::hardware_concurrency());
+
+        // Tracking needs the result of the previous frame, so the frames
+        // go through the detection stage one at a time in order
+        int track_interval = max(0, cmdParser.get<int>("track"));
+        int detectors = track_interval > 0 ? 1 : workers;
+
+        // Enough frames to fill every queue and keep every thread busy
+        size_t pool_size = 4 * depth + detectors + workers + 2;
+        FramePool<Frame> pool(pool_size);
+
+        FrameQueue detect_queue(depth);
+        FrameQueue decode_queue(depth);
+        FrameQueue render_queue(depth);
+        FrameQueue display_queue(depth);
+        FrameQueue encode_queue(depth);
+
+        atomic<bool> running(true);
+        atomic<int> active_detectors(detectors);
+        atomic<int> active_decoders(workers);
+        atomic<uint64_t> frames_done(0);
+        atomic<uint64_t> warm_allocations(0);
+
+        StageTimes times;
+
+        VideoOutput video_output(video_options, times.video);
+        if (video_output.enabled())
+                cout << "Writing result to video file: " << output_file << endl;
+
+        // The pose is only needed to draw the shapes or to write it out
+        bool draw = video_output.enabled() || !headless;
+        bool with_pose = draw || detections != nullptr || log.is_open() || publisher.is_open();
+
+        // The tracking detector also decodes the markers and computes their pose
+        unique_ptr<Detector> tracker;
+        if (track_interval > 0) {
+                DetectorOptions options;
+                options.pyramid_level = pyramid_level;
+                options.tolerance = cmdParser.get<int>("tolerance");
+                options.track_interval = track_interval;
+                options.with_pose = with_pose;
+                tracker.reset(new Detector(camera, decoding_table, options));
         }
+
+        //
+        // Pipeline
+        //
+        // capture -> detect -> decode -> render -> display -> encode
+        //
+        // Detection and decoding run on several threads and may finish
+        // the frames out of order. The render stage puts them back in order.
+        // The display stays on the main thread as required by highgui.
+        // In headless mode there is no display stage and nothing is drawn
+        // unless the video is written
+        //
+        String trace_file = cmdParser.get<String>("trace");
+        if (trace_file != "") {
+                trace_start();
+                trace_thread_name("display");
+        }
+
+        vector<thread> threads;
+        high_resolution_clock::time_point start_t = high_resolution_clock::now();
+
+        atomic<bool> reporting(true);
+        int stats_interval = cmdParser.get<int>("stats");
+        thread reporter;
+        if (stats_interval > 0)
+                reporter = thread(report_latencies, ref(reporting), stats_interval, cref(times));
+
+        threads.push_back(thread(capture_frames, ref(stream0), input_stream == "", gray_capture,
+                ref(pool), ref(detect_queue), ref(running), ref(times)));
+
+        RejectCounters rejects;
+        mutex rejects_mtx;
+        for(int w = 0; w < detectors; ++w) {
+                threads.push_back(thread(detect_frames, ref(detect_queue), ref(decode_queue),
+                        ref(active_detectors), pyramid_level, tracker.get(), ref(rejects), ref(rejects_mtx), ref(times)));
+        }
+
+        for(int w = 0; w < workers; ++w) {
+                threads.push_back(thread(decode_frames, ref(decode_queue), ref(render_queue),
+                        ref(active_decoders), cref(decoding_table), with_pose, cref(camera), ref(times)));
+        }
+
+        FrameQueue &rendered_queue = headless ? encode_queue : display_queue;
+
+        threads.push_back(thread(render_frames, ref(render_queue), ref(rendered_queue), pool_size,
+                draw, ref(current_shape), cref(camera), publisher.is_open() ? &publisher : nullptr, ref(times)));
+        threads.push_back(thread(encode_frames, ref(encode_queue), ref(video_output), detections,
+                log.is_open() ? &log : nullptr, ref(pool), ref(frames_done), ref(warm_allocations), ref(times)));
+
+        if(!headless) {
+                namedWindow(CAMERA_WIN, WINDOW_AUTOSIZE);
+                display_frames(display_queue, encode_queue, running, current_shape, times);
+        }
+
+        for(auto &t : threads) t.join();
+        video_output.close();
+        if (log.is_open() && !log.close())
+                cerr << "Cannot write the detection log \"" + log_name + "\"" << endl;
+
+        reporting = false;
+        if (reporter.joinable())
+                reporter.join();
+
+        duration<double> total_time = high_resolution_clock::now() - start_t;
+        print_stage_times(frames_done, total_time.count(), times, cmdParser.get<double>("deadline"));
+
+        if (tracker)
+                add_reject_counters(rejects, tracker->reject_counters());
+        print_reject_counters(cout, rejects);
+
+        String latency_file = cmdParser.get<String>("latency");
+        if (latency_file != "" && !write_latencies(latency_file, times))
+                cerr << "Cannot write the latencies to \"" + latency_file + "\"" << endl;
+
+        if (trace_file != "" && !trace_write(trace_file))
+                cerr << "Cannot write the trace to \"" + trace_file + "\"" << endl;
+
+        if (video_output.enabled())
+                cout << "Annotated frames written: " << video_output.written()
+                     << ", dropped: " << video_output.dropped() << endl;
+
+        double allocations = allocations_per_frame(frames_done, warm_allocations);
+        if (allocations >= 0)
+                cout << "Heap allocations per frame: " << allocations << endl;
+
         stream0.release();
-        destroyAllWindows();
-}
+        if(!headless)
+                destroyAllWindows();
 
-// Read the text file containing the camera matrix and the distortion coefficients
-//
-// The first line of the file are the 9 values of the camera matrix.
-// The second line are the 5 distortion coefficients
-// See https://docs.opencv.org/2.4/doc/tutorials/calib3d/camera_calibration/camera_calibration.html
-void calibrate_camera(String filename, Mat &camMatrix, Mat &distCoeffs) {
-        ifstream fs(filename);
-
-        if(fs.is_open()) {
-                double camData[9], distData[5];
-                
-                for(int e = 0; e < 9; ++e) fs >> camData[e];
-                for(int e = 0; e < 5; ++e) fs >> distData[e];
-
-                Mat camMatrixTemp(3, 3, DataType<double>::type, camData);
-                Mat distCoeffsTemp(5, 1, cv::DataType<double>::type, distData);
-
-                camMatrixTemp.copyTo(camMatrix);
-                distCoeffsTemp.copyTo(distCoeffs);
-                
-                cout << camMatrix << endl;
-                cout << distCoeffs << endl;
-                cout << "Camera calibrated correctly" << endl;
-
-                fs.close();
-        } else {
-                cerr << "File \"" + filename + "\" does not exist " << endl;
-                exit(1);
+        double max_allocations = cmdParser.get<double>("max_allocations");
+        if (max_allocations >= 0 && allocations > max_allocations) {
+                cerr << "More than " << max_allocations << " heap allocations per frame" << endl;
+                return 1;
         }
 }
 
-// Given a camera frame detect the aruco markes on it
+// Show the frames on screen and handle the key events
 //
-// From all of the contours of the image discard the ones that are no arucos
-// For this we assume the following:
-//   Arucos are rectangular or square shaped
-//   Arucos are of small
-//   Arucos have at least one child contour
-void detect_arucos(Mat &frame, vector<Aruco > &arucos) {
-        
-        vector<vector<Point> > contours;
-        vector<Vec4i> hierarchy;
-
-        // hierarchy has as many elements as contours there are
-        // hierarchy[i][0] is the index of the next contour at the same level
-        // hierarchy[i][1] is the index of the previous contour at the same level
-        // hierarchy[i][2] is the index of the children contour
-        // hierarchy[i][3] is the index of the parent contour
-        // If one index is -1 then that element does not exist
-        findContours(frame, contours, hierarchy, RETR_TREE, CHAIN_APPROX_SIMPLE);
-
-        for(size_t c = 0; c < contours.size(); ++c) {
-                double perimeter = arcLength(contours[c], true);
-                double area = contourArea(contours[c]);
-
-                if (area < 500) continue;
-                vector<Point> possible_marker;
-                approxPolyDP(contours[c], possible_marker, 0.005 * perimeter, true);
-
-                // Discard shapes
-                if (possible_marker.size() != 4) continue;
-                if (hierarchy[c][2] != -1 && hierarchy[c][3] == -1) continue;
-                
-                Aruco marker;
-
-                for(auto v : possible_marker) {
-                        marker.vertex.push_back(Point2f(v));
+// Runs on the main thread as required by highgui
+void display_frames(FrameQueue &in, FrameQueue &out, atomic<bool> &running, atomic<Shape> &current_shape, StageTimes &times) {
+        Frame *frame;
+        while(in.pop(frame)) {
+                trace_frame(frame->index);
+                high_resolution_clock::time_point start_t = high_resolution_clock::now();
+
+                // Keep forwarding the frames still in flight after quitting
+                // so that the upstream stages can finish
+                if (running) {
+                        TRACE_SCOPE("imshow");
+                        imshow(CAMERA_WIN, frame->annotated);
+
+                        // Handle key events
+                        char key_pressed = waitKey(1);
+                        switch(key_pressed) {
+                                case ESC:
+                                case 'q':
+                                        running = false;
+                                        break;
+                                case 'a':
+                                        Shape next_shape = current_shape;
+                                        current_shape = ++next_shape;
+                        }
                 }
-                
-                Moments m = moments(contours[c], true);
-                marker.center = Point2f(double(m.m10 / m.m00), double(m.m01 / m.m00));
+                add_time(times.display, start_t);
 
-                // Push only markers that have been correctly identified
-                arucos.push_back(marker);
+                out.push(frame);
         }
+        out.close();
 }
 
-// Given a vector or Aruco markers draw them on the frame
+// Read frames from the stream until it ends or the user quits
 //
-// Draw the ID of the marker at its center, the border of the
-// marker and its shape above it
-void draw_arucos(Mat &frame, vector<Aruco> &arucos, Shape current_shape, Mat &camMatrix, Mat &distCoeffs) {
-        
-        if(arucos.size() == 0) return;
+// Webcam frames are marked to be mirrored on screen, so they behave like
+// a mirror. The pixels are not moved, the markers are found where the
+// camera sees them.
+// With gray, the frames are read raw and only their luma is kept
+void capture_frames(VideoCapture &stream, bool mirror, bool gray, FramePool<Frame> &pool, FrameQueue &out, atomic<bool> &running, StageTimes &times) {
+        uint64_t index = 0;
+        trace_thread_name("capture");
 
-        for(auto aruco: arucos) {
-                if (aruco.id == -1) continue;
+        int fourcc = int(stream.get(CV_CAP_PROP_FOURCC));
+        Size size(stream.get(CV_CAP_PROP_FRAME_WIDTH), stream.get(CV_CAP_PROP_FRAME_HEIGHT));
 
-                // Rotation and translation matrixes
-                Mat rvec, tvec;
-        
-                // Draw the first border vertex
-                aruco.first_vertex = aruco.vertex[aruco.id % 4];
-                circle(frame, aruco.first_vertex, 8, Scalar(0, 0, 255), 2);
-                
-                // Draw id at the center of the marker
-                putText(frame, "id=" + to_string(aruco.id),
-                        aruco.center, FONT_HERSHEY_SIMPLEX,
-                        0.7, cvScalar(0, 0, 255), 1, CV_AA);
-
-                // Draw the border of the marker
-                draw_square(frame, aruco.vertex, Scalar(0, 255, 0));
-
-                // Draw the figure of the given marker
-                // aruco.shape = ARUCO_LUT.at(aruco.id);
-                aruco.shape = current_shape;
-
-                // Projection of the 3d cube points into the camera frame
-                vector<Point2d> cube_output_points;
-                vector<Point2d> pyramid_output_points;
-                vector<Point2d> pyramid_inv_output_points;
-                vector<Point2d> pyramid_side_output_points;
-
-                //
-                // Cube data
-                // 
-                // 3d coordinates of the upper face of the cube
-                vector<Point3d> cube_3d;
-                cube_3d.push_back(Point3d(aruco.vertex[0].x, aruco.vertex[0].y, -250));
-                cube_3d.push_back(Point3d(aruco.vertex[1].x, aruco.vertex[1].y, -250));
-                cube_3d.push_back(Point3d(aruco.vertex[2].x, aruco.vertex[2].y, -250));
-                cube_3d.push_back(Point3d(aruco.vertex[3].x, aruco.vertex[3].y, -250));
-                
-                // 3d coordinates of the lower face of the cube
-                vector<Point3d> cube_points_plain;
-                cube_points_plain.push_back(Point3d(aruco.vertex[0].x, aruco.vertex[0].y, 0));
-                cube_points_plain.push_back(Point3d(aruco.vertex[1].x, aruco.vertex[1].y, 0));
-                cube_points_plain.push_back(Point3d(aruco.vertex[2].x, aruco.vertex[2].y, 0));
-                cube_points_plain.push_back(Point3d(aruco.vertex[3].x, aruco.vertex[3].y, 0));
-
-                //
-                // Inverted pyramid data
-                // 
-                // 3d coordinates of the upper face of the cube
-                vector<Point3d> pyramid_inv_3d;
-                pyramid_inv_3d.push_back(Point3d(aruco.vertex[0].x, aruco.vertex[0].y, -250));
-                pyramid_inv_3d.push_back(Point3d(aruco.vertex[1].x, aruco.vertex[1].y, -250));
-                pyramid_inv_3d.push_back(Point3d(aruco.vertex[2].x, aruco.vertex[2].y, -250));
-                pyramid_inv_3d.push_back(Point3d(aruco.vertex[3].x, aruco.vertex[3].y, -250));
-                pyramid_inv_3d.push_back(Point3d((aruco.vertex[0].x + aruco.vertex[2].x)/2, (aruco.vertex[1].y + aruco.vertex[3].y)/2, 0));
-
-                //
-                // Pyramid on its side data
-                //
-                // // 3d coordinates of the upper face of the side pyramid
-                vector<Point3d> pyramid_side_3d;
-                pyramid_side_3d.push_back(Point3d(aruco.vertex[0].x, aruco.vertex[0].y, -250));
-                pyramid_side_3d.push_back(Point3d(aruco.vertex[3].x, aruco.vertex[3].y, -250));
-                pyramid_side_3d.push_back(Point3d(aruco.vertex[1].x, (aruco.vertex[1].y + aruco.vertex[2].y)/2, -120));
-
-                //
-                // Pyramid data
-                //
-                // 3d coordinates of the upper face of the pyramid
-                // TODO: Calculate the correct point
-                vector<Point3d> pyramid_3d;
-                pyramid_3d.push_back(Point3d((aruco.vertex[0].x + aruco.vertex[2].x)/2, (aruco.vertex[1].y + aruco.vertex[3].y)/2, -360));
-
-                switch(aruco.shape) {
-                        case Shape::Prism_5:
-                        case Shape::Pyramid:
-                                
-                                solvePnP(cube_points_plain, aruco.vertex, camMatrix, distCoeffs, rvec, tvec);
-                                projectPoints(pyramid_3d, rvec, tvec, camMatrix, distCoeffs, pyramid_output_points);
-                                
-                                for(size_t l = 0; l < aruco.vertex.size(); ++l) {
-                                        line(frame, aruco.vertex[l], pyramid_output_points[0], Scalar(0, 255, 255), 2);
-                                }
+        while(running) {
+                Frame *frame = pool.acquire();
+                if (frame == nullptr) break;
+
+                trace_frame(index);
+                high_resolution_clock::time_point start_t = high_resolution_clock::now();
+                {
+                        TRACE_SCOPE("capture");
+                        if (!stream.read(gray ? frame->raw : frame->image)) {
+                                cout << "Failed to read camera frame" << endl;
+                                pool.release(frame);
                                 break;
-                                
-                        case Shape::Pyramid_side:
-
-                                solvePnP(cube_points_plain, aruco.vertex, camMatrix, distCoeffs, rvec, tvec);
-                                projectPoints(pyramid_side_3d, rvec, tvec, camMatrix, distCoeffs, pyramid_side_output_points);
+                        }
+                        if (gray && !luma_plane(frame->raw, fourcc, size, frame->image)) {
+                                cout << "Unknown format of the raw camera frames" << endl;
+                                pool.release(frame);
+                                break;
+                        }
+                        frame->mirror = mirror;
+                }
+                add_time(times.capture, start_t);
 
-                                line(frame, aruco.vertex[0], pyramid_side_output_points[0], Scalar(0, 255, 255), 2);
-                                line(frame, aruco.vertex[3], pyramid_side_output_points[1], Scalar(0, 255, 255), 2);
-                                line(frame, pyramid_side_output_points[0], pyramid_side_output_points[1], Scalar(0, 255, 255), 2);
+                frame->captured = high_resolution_clock::now();
 
-                                line(frame, aruco.vertex[0], pyramid_side_output_points[2], Scalar(0, 255, 255), 2);
-                                line(frame, aruco.vertex[3], pyramid_side_output_points[2], Scalar(0, 255, 255), 2);
-                                line(frame, pyramid_side_output_points[0], pyramid_side_output_points[2], Scalar(0, 255, 255), 2);
-                                line(frame, pyramid_side_output_points[1], pyramid_side_output_points[2], Scalar(0, 255, 255), 2);
+                frame->index = index++;
+                if (!out.push(frame)) break;
+        }
+        out.close();
+}
 
-                                break;
-                                                                
-                        case Shape::Pyramid_inv:
-                                
-                                solvePnP(cube_points_plain, aruco.vertex, camMatrix, distCoeffs, rvec, tvec);
-                                projectPoints(pyramid_inv_3d, rvec, tvec, camMatrix, distCoeffs, pyramid_inv_output_points);
-
-                                draw_square(frame, pyramid_inv_output_points);
-
-                                for(size_t l = 0; l < pyramid_inv_output_points.size() - 1; ++l) {
-                                        line(frame, pyramid_inv_output_points[l], pyramid_inv_output_points[(l+1)%4], Scalar(0, 255, 255), 2);
-                                }
-                                
-                                for(size_t l = 0; l < pyramid_inv_output_points.size() - 1; ++l) {
-                                        line(frame, pyramid_inv_output_points[l], pyramid_inv_output_points[4], Scalar(0, 255, 255), 2);
-                                }
-                                break;
-                                
-                        case Shape::Cube:
-                                
-                                solvePnP(cube_points_plain, aruco.vertex, camMatrix, distCoeffs, rvec, tvec);
-                                projectPoints(cube_3d, rvec, tvec, camMatrix, distCoeffs, cube_output_points);
-
-                                // Draw the upper border
-                                draw_square(frame, cube_output_points);
-
-                                // Draw vertical lines
-                                for(size_t l = 0; l < cube_output_points.size(); ++l) {
-                                        line(frame, aruco.vertex[l], cube_output_points[l], Scalar(0, 255, 255), 2);
-                                }
-                                break;
-                                
-                        default:
-                                break;
+// Threshold the frame and find the possible aruco markers
+//
+// With a tracking detector, the markers of the previous frame are
+// searched around their predicted position and the whole frame is only
+// scanned every few frames or when a marker is lost. The markers are
+// decoded by the detector because only those that are identified are
+// tracked, and their pose starts from the pose of their track.
+// Several detectors run in parallel when there is no tracking. The
+// last one to finish closes the output queue.
+// The counters of the contour filter are added to rejects when done
+void detect_frames(FrameQueue &in, FrameQueue &out, atomic<int> &active, int pyramid_level, Detector *tracker,
+        RejectCounters &rejects, mutex &rejects_mtx, StageTimes &times) {
+        DetectScratch scratch;
+        Frame *frame;
+        trace_thread_name("detect");
+
+        while(in.pop(frame)) {
+                trace_frame(frame->index);
+
+                if (tracker == nullptr) {
+                        prepare_frame(*frame);
+                        find_markers(*frame, pyramid_level, scratch);
+                } else {
+                        tracker->detect_frame(*frame);
+                        times.decode.record(frame->decode_ns);
+                        times.pose.record(frame->pose_ns);
                 }
+                times.preprocess.record(frame->preprocess_ns);
+                times.contours.record(frame->contours_ns);
+
+                out.push(frame);
+        }
+
+        {
+                lock_guard<mutex> lock(rejects_mtx);
+                add_reject_counters(rejects, scratch.contours.counters);
         }
+        if (--active == 0) out.close();
 }
 
-// Given a flat image containing an aruco extract the data of the marker
+// Extract information about the aruco markers found in the frame
 //
-// Return the id of the aruco if it is found
-// Return -1 otherwise
-char read_marker_dictionary(Mat &aruco_img) {
+// Several decoders run in parallel. The last one to finish closes
+// the output queue. The pose of each marker is computed once here and
+// used both to draw the shapes and to write the detections
+void decode_frames(FrameQueue &in, FrameQueue &out, atomic<int> &active, const DecodingTable &decoding_table,
+        bool with_pose, const Camera &camera, StageTimes &times) {
+        Frame *frame;
+        PoseScratch pose_scratch;
+        trace_thread_name("decode");
+
+        while(in.pop(frame)) {
+                trace_frame(frame->index);
+                if (!frame->decoded) {
+                        high_resolution_clock::time_point start_t = high_resolution_clock::now();
+                        decode_markers(*frame, decoding_table);
+                        add_time(times.decode, start_t);
+
+                        if (with_pose) {
+                                start_t = high_resolution_clock::now();
+                                estimate_poses(*frame, camera, nullptr, pose_scratch);
+                                add_time(times.pose, start_t);
+                        }
+                }
 
-        Mat aruco_temp;
-        Mat aruco_output;
-        
-        // Convert to grayscale
-        if (aruco_img.channels() > 1)
-                cvtColor(aruco_img, aruco_img, CV_BGR2GRAY);
+                out.push(frame);
+        }
 
-        // Use Otsu to approximate the threshold level
-        double thresh = threshold(aruco_img, aruco_temp,
-                180, 255, THRESH_BINARY | THRESH_OTSU);
-        
-        threshold(aruco_temp, aruco_output,
-                thresh, 255, THRESH_BINARY);
+        if (--active == 0) out.close();
+}
 
-        // With just 6x6 pixels we have more than enough information
-        resize(aruco_output, aruco_output, Size(6, 6));
+// Output the detected Aruco into the annotated frame
+//
+// Frames arrive in any order from the decoders. They are kept until
+// all of the previous frames have been rendered. There are never more
+// than max_pending frames in flight, so a frame is kept in the slot
+// given by its index modulo max_pending.
+// The markers are published as soon as the frame is in order, before
+// anything is drawn, so the consumers get them with the least delay.
+// A BGR image is drawn on in place. A gray image is converted to BGR
+// here, the only place that needs color. Mirrored frames are flipped
+// once the markers are drawn, so the text reads the right way.
+// If draw is false the frames are only put back in order
+void render_frames(FrameQueue &in, FrameQueue &out, size_t max_pending, bool draw, atomic<Shape> &current_shape, const Camera &camera,
+        DetectionPublisher *publisher, StageTimes &times) {
+        vector<Frame *> pending(max_pending, nullptr);
+        uint64_t next_index = 0;
+
+        // The labels are only rendered again when they change
+        Shape labelled_shape = current_shape;
+        string shape_label = "Shape: " + to_string(labelled_shape);
+        TextOverlay shape_overlay, fps_overlay;
 
-        uint8_t dict_temp[4][4];
-        
-        for(int c = 0; c < 4; ++c) {
-                for(int r = 0; r < 4; ++r) {
-                        dict_temp[c][r] = aruco_output.at<uint8_t>(c+1, r+1);
+        high_resolution_clock::time_point start_t, end_t;
+        float fps = 30.0;
+        string fps_label = "FPS: " + to_string(fps);
+        int frame_counter = 0;
+
+        DetectionRecord record;
+        DrawScratch draw_scratch;
+        Frame *frame;
+        trace_thread_name("render");
+
+        while(in.pop(frame)) {
+                pending[frame->index % max_pending] = frame;
+
+                while(pending[next_index % max_pending] != nullptr) {
+                        frame = pending[next_index % max_pending];
+                        pending[next_index % max_pending] = nullptr;
+                        next_index++;
+
+                        if(publisher != nullptr) {
+                                detection_record(*frame, record);
+                                publisher->publish(record);
+                        }
+
+                        if(!draw) {
+                                out.push(frame);
+                                continue;
+                        }
+                        trace_frame(frame->index);
+                        high_resolution_clock::time_point render_t = high_resolution_clock::now();
+
+                        // Estimation of the camera fps
+                        // If working with a video file we can use stream.get(CV_CAP_PROP_FPS)
+                        if(frame_counter == 0) {
+                                start_t = high_resolution_clock::now();
+                        };
+                        frame_counter++;
+
+                        Shape shape = current_shape;
+                        if (shape != labelled_shape) {
+                                labelled_shape = shape;
+                                shape_label = "Shape: " + to_string(shape);
+                        }
+
+                        if (frame->image.channels() == 1)
+                                cvtColor(frame->image, frame->annotated, CV_GRAY2BGR);
+                        else
+                                frame->annotated = frame->image;
+
+                        //
+                        // Draw the arucos
+                        //
+                        draw_arucos(frame->annotated, frame->arucos, shape, camera, draw_scratch);
+                        if (frame->mirror)
+                                flip(frame->annotated, frame->annotated, 1);
+
+                        // Calculate the fps to check if the algorithm works in real time
+                        if(frame_counter == NUM_FRAMES) {
+                                end_t = high_resolution_clock::now();
+                                duration<double, std::milli> time_span = end_t - start_t;
+                                fps = NUM_FRAMES * 1000 / (time_span.count());
+                                fps_label = "FPS: " + to_string(fps);
+                                frame_counter = 0;
+                        };
+
+                        draw_text(frame->annotated, fps_overlay, fps_label, Point(15, 40), 0.8, Scalar(0, 0, 255));
+                        draw_text(frame->annotated, shape_overlay, shape_label,
+                                Point(10, frame->annotated.rows - 10), 0.6, Scalar(0, 0, 255));
+                        add_time(times.render, render_t);
+
+                        out.push(frame);
                 }
         }
+        out.close();
+}
 
-        for(int m = 0; m < NUM_DICTS; ++m) {
-                if(!compare_matrixes(dict_temp, ARUCO_DICTS[m])) continue;
-                else return m; // Marker has been found
+// Hand the frames to the video writer and write the detections file, if
+// they are open, and give the frames back to the pool
+//
+// The writer copies the frame and encodes it on its own thread, so
+// the pipeline is never held by the encoder.
+//
+// The number of allocations made so far is saved once WARMUP_FRAMES
+// frames are done
+void encode_frames(FrameQueue &in, VideoOutput &video_output, ostream *detections, DetectionLogWriter *log,
+        FramePool<Frame> &pool, atomic<uint64_t> &frames_done, atomic<uint64_t> &warm_allocations, StageTimes &times) {
+        Frame *frame;
+        trace_thread_name("encode");
+
+        while(in.pop(frame)) {
+                trace_frame(frame->index);
+                high_resolution_clock::time_point start_t = high_resolution_clock::now();
+
+                if(video_output.enabled()) {
+                        TRACE_SCOPE("video_output.write");
+                        bool markers = any_of(frame->arucos.begin(), frame->arucos.end(),
+                                [](const Aruco &aruco) { return aruco.id != -1; });
+                        video_output.write(frame->annotated, markers);
+                }
+                if(detections != nullptr) {
+                        TRACE_SCOPE("write_detections");
+                        write_detections(*detections, *frame);
+                }
+                if(log != nullptr) {
+                        TRACE_SCOPE("log_detections");
+                        log_detections(*log, *frame);
+                }
+                add_time(times.encode, start_t);
+                add_time(times.total, frame->captured);
+
+                if (++frames_done == WARMUP_FRAMES)
+                        warm_allocations = allocation_count();
+                pool.release(frame);
         }
+}
+
+// Add the time elapsed since start to the histogram of a stage
+void add_time(LatencyHistogram &stage, high_resolution_clock::time_point start) {
+        stage.record(elapsed_ns(start));
+}
+
+// Name and histogram of each stage, in the order of the pipeline
+//
+// total is the latency from the capture until the frame is written out
+vector<StageLatency> stage_latencies(const StageTimes &times) {
+        return {
+                {"capture",    &times.capture},
+                {"preprocess", &times.preprocess},
+                {"contours",   &times.contours},
+                {"decode",     &times.decode},
+                {"pose",       &times.pose},
+                {"render",     &times.render},
+                {"display",    &times.display},
+                {"encode",     &times.encode},
+                {"video",      &times.video},
+                {"total",      &times.total},
+        };
+}
 
-        return -1; // No id found
+// Print the throughput and the latency of each stage of the pipeline
+//
+// With a deadline, also print how many frames missed it
+void print_stage_times(uint64_t frames, double seconds, const StageTimes &times, double deadline_ms) {
+        cout << "Processed " << frames << " frames in " << seconds << " s ("
+             << (seconds > 0 ? frames / seconds : 0.0) << " fps)" << endl;
+
+        print_latencies(cout, times);
+
+        if (deadline_ms > 0) {
+                uint64_t late = times.total.count_above(int64_t(deadline_ms * 1e6));
+                cout << "Frames over the " << deadline_ms << " ms deadline: " << late
+                     << " (" << (frames ? 100.0 * late / frames : 0.0) << "%)" << endl;
+        }
 }
 
+// Print the total time and the percentiles of each stage, in ms
+//
+// Stages running on several threads add up the time of all of them
+void print_latencies(ostream &os, const StageTimes &times) {
+        streamsize precision = os.precision();
+        os << "  stage        total     p50     p95     p99     max" << endl;
+
+        for(auto &stage : stage_latencies(times)) {
+                const LatencyHistogram &h = *stage.second;
+                if (h.count() == 0) continue;
+
+                os << "  " << left << setw(10) << stage.first << right << fixed << setprecision(2)
+                   << setw(8) << h.total_ns() / 1e6
+                   << setw(8) << h.percentile(0.50) / 1e6
+                   << setw(8) << h.percentile(0.95) / 1e6
+                   << setw(8) << h.percentile(0.99) / 1e6
+                   << setw(8) << h.max_ns() / 1e6 << endl;
+        }
+        os << defaultfloat << setprecision(precision);
+}
 
-// Compares the squares matrix of the given size
+// Print the latencies every interval seconds while reporting is set
 //
-// Returns true if the two matrix are equal
-// Returns false otherwise
-bool compare_matrixes(const uint8_t left_m[4][4], const uint8_t right_m[4][4]) {
-        for(int col = 0; col < 4; ++col) {
-                for(int row = 0; row < 4; ++row) {
-                        if(left_m[col][row] != right_m[col][row])
-                                return false;
+// The histograms are not reset, so each summary covers the whole run
+void report_latencies(atomic<bool> &reporting, int interval, const StageTimes &times) {
+        high_resolution_clock::time_point last_t = high_resolution_clock::now();
+
+        while(reporting) {
+                this_thread::sleep_for(milliseconds(100));
+
+                if (high_resolution_clock::now() - last_t >= seconds(interval)) {
+                        last_t = high_resolution_clock::now();
+                        cout << "Latency after " << times.total.count() << " frames (ms)" << endl;
+                        print_latencies(cout, times);
                 }
         }
-        return true;
 }
 
-// Given 4 vertex, draw a square with them
-template<class V>
-void draw_square(Mat &frame, const vector<V> &v, Scalar color, int thickness) {
-        if (v.size() != 4) return;
+// Write the latency of each stage to a file, in ms
+//
+// Files ending in .csv get a row per stage, other files a JSON object:
+// {"capture": {"count": 100, "mean_ms": 1.2, "p50_ms": 1.1, "p95_ms": 2.0, "p99_ms": 2.5, "max_ms": 3.1}, ...}
+// Return false if the file cannot be written
+bool write_latencies(const String &filename, const StageTimes &times) {
+        ofstream os(filename);
+        if (!os.is_open()) return false;
 
-        for(size_t l = 0; l < v.size(); ++l) {
-                line(frame, v[l], v[(l + 1) %4], color, thickness);
+        bool csv = filename.size() >= 4 && filename.substr(filename.size() - 4) == ".csv";
+
+        if (csv)
+                os << "stage,count,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n";
+        else
+                os << "{";
+
+        bool first = true;
+        for(auto &stage : stage_latencies(times)) {
+                const LatencyHistogram &h = *stage.second;
+
+                if (csv) {
+                        os << stage.first << "," << h.count() << "," << h.mean_ns() / 1e6
+                           << "," << h.percentile(0.50) / 1e6 << "," << h.percentile(0.95) / 1e6
+                           << "," << h.percentile(0.99) / 1e6 << "," << h.max_ns() / 1e6 << "\n";
+                } else {
+                        os << (first ? "" : ", ") << "\"" << stage.first << "\": {\"count\": " << h.count()
+                           << ", \"mean_ms\": " << h.mean_ns() / 1e6
+                           << ", \"p50_ms\": " << h.percentile(0.50) / 1e6
+                           << ", \"p95_ms\": " << h.percentile(0.95) / 1e6
+                           << ", \"p99_ms\": " << h.percentile(0.99) / 1e6
+                           << ", \"max_ms\": " << h.max_ns() / 1e6 << "}";
+                }
+                first = false;
         }
+
+        if (!csv)
+                os << "}\n";
+        return true;
+}
+
+// Average number of heap allocations of the frames after the warm up
+//
+// Return -1 if there were not enough frames to tell
+double allocations_per_frame(uint64_t frames, uint64_t warm_allocations) {
+        if (frames <= WARMUP_FRAMES) return -1;
+
+        return double(allocation_count() - warm_allocations) / (frames - WARMUP_FRAMES);
 }
@@ -0,0 +1,130 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// What to do with a new frame while every buffer is in flight
+enum class DropPolicy {
+        // Wait for a frame to be done, nothing is lost. For files
+        Block,
+        // Skip the new frame so the latency stays bounded. For cameras
+        Drop
+};
+
+// Queue with a fixed capacity used to connect the stages of the pipeline
+//
+// The items are kept in a ring allocated once, so pushing and popping
+// never allocate.
+// push blocks while the queue is full and pop blocks while it is empty.
+// Once the queue is closed push fails and pop returns the remaining
+// items before failing too, so consumers know when to stop.
+template<class T>
+class BoundedQueue {
+public:
+        explicit BoundedQueue(size_t capacity) : items(capacity), head(0), count(0), closed(false) {}
+
+        // Block until there is room for the item
+        //
+        // Return false if the queue has been closed
+        bool push(T item) {
+                std::unique_lock<std::mutex> lock(mtx);
+                not_full.wait(lock, [this] { return closed || count < items.size(); });
+                if (closed) return false;
+
+                items[(head + count) % items.size()] = item;
+                count++;
+                not_empty.notify_one();
+                return true;
+        }
+
+        // Block until there is an item available
+        //
+        // Return false if the queue is closed and empty
+        bool pop(T &item) {
+                std::unique_lock<std::mutex> lock(mtx);
+                not_empty.wait(lock, [this] { return closed || count > 0; });
+                if (count == 0) return false;
+
+                item = items[head];
+                head = (head + 1) % items.size();
+                count--;
+                not_full.notify_one();
+                return true;
+        }
+
+        // Take an item only if there is one available
+        //
+        // Return false if the queue is empty
+        bool try_pop(T &item) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (count == 0) return false;
+
+                item = items[head];
+                head = (head + 1) % items.size();
+                count--;
+                not_full.notify_one();
+                return true;
+        }
+
+        // Wake up every thread waiting on the queue
+        void close() {
+                std::lock_guard<std::mutex> lock(mtx);
+                closed = true;
+                not_empty.notify_all();
+                not_full.notify_all();
+        }
+
+private:
+        std::mutex mtx;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::vector<T> items;
+        size_t head;
+        size_t count;
+        bool closed;
+};
+
+// Fixed set of reusable objects
+//
+// The objects are allocated once and handed out by pointer, so the
+// buffers they own (images, vectors) are kept between frames.
+// acquire blocks when every object is in use, which limits the number
+// of frames in flight.
+template<class T>
+class FramePool {
+public:
+        explicit FramePool(size_t size) : frames(size), free_frames(size) {
+                for(auto &f : frames) free_frames.push(&f);
+        }
+
+        // Return nullptr if the pool has been closed
+        T *acquire() {
+                T *f = nullptr;
+                free_frames.pop(f);
+                return f;
+        }
+
+        // Return nullptr if every object is in use
+        T *try_acquire() {
+                T *f = nullptr;
+                free_frames.try_pop(f);
+                return f;
+        }
+
+        void release(T *f) {
+                free_frames.push(f);
+        }
+
+        void close() {
+                free_frames.close();
+        }
+
+private:
+        std::vector<T> frames;
+        BoundedQueue<T *> free_frames;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include <new>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm_ring.hpp"
+
+size_t record_size(uint32_t count);
+void close_ring(const std::string &name);
+
+// Bytes of a record holding count markers
+size_t record_size(uint32_t count) {
+        return offsetof(DetectionRecord, markers) + std::min<uint32_t>(count, RECORD_MAX_MARKERS) * sizeof(MarkerRecord);
+}
+
+// Mark a ring that is ready as closed, so that its readers stop following it
+void close_ring(const std::string &name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) return;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(RingHeader)) {
+                close(fd);
+                return;
+        }
+
+        void *mapping = mmap(nullptr, sizeof(RingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return;
+
+        RingHeader *ring = static_cast<RingHeader *>(mapping);
+        uint32_t ready = RING_READY;
+        if (memcmp(ring->magic, RING_MAGIC, sizeof(ring->magic)) == 0 && ring->version == RING_VERSION)
+                ring->state.compare_exchange_strong(ready, RING_CLOSED, std::memory_order_release, std::memory_order_relaxed);
+        munmap(mapping, sizeof(RingHeader));
+}
+
+// Close the ring and remove its name
+//
+// The name is left alone if it was taken over by another publisher
+DetectionPublisher::~DetectionPublisher() {
+        if (header == nullptr) return;
+
+        header->state.store(RING_CLOSED, std::memory_order_release);
+        munmap(header, size);
+
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return;
+
+        struct stat info;
+        bool ours = fstat(fd, &info) == 0 && uint64_t(info.st_dev) == device && uint64_t(info.st_ino) == inode;
+        close(fd);
+        if (ours) shm_unlink(name.c_str());
+}
+
+// Create the shared memory and lay out the ring in it
+//
+// The memory starts zeroed, which is an empty ring in RING_SETUP. The
+// state is set to RING_READY last, so that a reader never takes a ring
+// being set up for a valid one. A ring of the same name is closed first,
+// so that its readers know to open the name again
+bool DetectionPublisher::open(const std::string &ring_name, uint32_t slot_count) {
+        if (header != nullptr || slot_count == 0) return false;
+
+        close_ring(ring_name);
+        shm_unlink(ring_name.c_str());
+        int fd = shm_open(ring_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) return false;
+
+        struct stat info;
+        size_t ring_size = sizeof(RingHeader) + size_t(slot_count) * sizeof(RingSlot);
+        if (fstat(fd, &info) != 0 || ftruncate(fd, ring_size) != 0) {
+                close(fd);
+                shm_unlink(ring_name.c_str());
+                return false;
+        }
+
+        void *mapping = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+                shm_unlink(ring_name.c_str());
+                return false;
+        }
+
+        name = ring_name;
+        size = ring_size;
+        device = uint64_t(info.st_dev);
+        inode = uint64_t(info.st_ino);
+        header = static_cast<RingHeader *>(mapping);
+        slots = reinterpret_cast<RingSlot *>(header + 1);
+
+        new (&header->state) std::atomic<uint32_t>(RING_SETUP);
+        new (&header->head) std::atomic<uint64_t>(0);
+        for(uint32_t s = 0; s < slot_count; ++s) {
+                new (&slots[s].sequence) std::atomic<uint64_t>(0);
+        }
+        memcpy(header->magic, RING_MAGIC, sizeof(header->magic));
+        header->version = RING_VERSION;
+        header->slot_count = slot_count;
+        header->slot_size = sizeof(RingSlot);
+
+        header->state.store(RING_READY, std::memory_order_release);
+        return true;
+}
+
+// Write a record into the next slot
+//
+// The slot is marked as being written, filled and marked complete, and
+// then the head is moved on. Only the markers in use are copied
+void DetectionPublisher::publish(const DetectionRecord &record) {
+        if (header == nullptr) return;
+
+        uint64_t n = next_sequence++;
+        RingSlot &slot = slots[n % header->slot_count];
+
+        slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        memcpy(&slot.record, &record, record_size(record.count));
+
+        slot.sequence.store(2 * n + 2, std::memory_order_release);
+        header->head.store(n + 1, std::memory_order_release);
+}
+
+DetectionReader::~DetectionReader() {
+        close();
+}
+
+void DetectionReader::close() {
+        if (header != nullptr)
+                munmap(const_cast<RingHeader *>(header), size);
+        header = nullptr;
+        slots = nullptr;
+}
+
+// Map the ring read only and check that it has the layout of this build
+//
+// The state is loaded before anything else of the header is read. The
+// magic, version and layout are only valid once it is RING_READY
+bool DetectionReader::open(const std::string &name) {
+        if (header != nullptr) return false;
+
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(RingHeader)) {
+                ::close(fd);
+                return false;
+        }
+
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) return false;
+
+        const RingHeader *ring = static_cast<const RingHeader *>(mapping);
+
+        if (ring->state.load(std::memory_order_acquire) != RING_READY
+                || memcmp(ring->magic, RING_MAGIC, sizeof(ring->magic)) != 0
+                || ring->version != RING_VERSION
+                || ring->slot_size != sizeof(RingSlot)
+                || ring->slot_count == 0
+                || size_t(info.st_size) < sizeof(RingHeader) + size_t(ring->slot_count) * sizeof(RingSlot)) {
+                munmap(mapping, info.st_size);
+                return false;
+        }
+
+        header = ring;
+        slots = reinterpret_cast<const RingSlot *>(header + 1);
+        size = info.st_size;
+        next_sequence = header->head.load(std::memory_order_acquire);
+        return true;
+}
+
+bool DetectionReader::closed() const {
+        return header == nullptr || header->state.load(std::memory_order_acquire) == RING_CLOSED;
+}
+
+// Copy the next record if it is complete
+//
+// The copy is only kept if the sequence of the slot did not change while
+// it was made. A record overwritten before or during the copy is lost
+// and the reader moves on, it never waits for the producer
+bool DetectionReader::next(DetectionRecord &record) {
+        if (header == nullptr) return false;
+        const uint64_t slot_count = header->slot_count;
+
+        while(true) {
+                uint64_t head = header->head.load(std::memory_order_acquire);
+                if (next_sequence >= head) return false;
+
+                // The producer went round the ring past the reader
+                if (head - next_sequence > slot_count) {
+                        lost_records += head - slot_count - next_sequence;
+                        next_sequence = head - slot_count;
+                }
+
+                const RingSlot &slot = slots[next_sequence % slot_count];
+                const uint64_t complete = 2 * next_sequence + 2;
+
+                if (slot.sequence.load(std::memory_order_acquire) == complete) {
+                        memcpy(&record, &slot.record, offsetof(DetectionRecord, markers));
+                        memcpy(record.markers, slot.record.markers,
+                                record_size(record.count) - offsetof(DetectionRecord, markers));
+
+                        std::atomic_thread_fence(std::memory_order_acquire);
+                        if (slot.sequence.load(std::memory_order_relaxed) == complete) {
+                                next_sequence++;
+                                return true;
+                        }
+                }
+
+                lost_records++;
+                next_sequence++;
+        }
+}
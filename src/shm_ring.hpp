@@ -0,0 +1,139 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Most markers kept in the record of a frame
+#define RECORD_MAX_MARKERS 64
+
+// Rings start with this magic and version
+#define RING_MAGIC "ARUCORNG"
+#define RING_VERSION 2
+
+// State of a ring. A ring is only read once it is ready, and a closed
+// ring is no longer written: its publisher is gone or was replaced
+#define RING_SETUP 0
+#define RING_READY 1
+#define RING_CLOSED 2
+
+// Marker of a published frame
+//
+// The corners are in pixels, in the order given by the detector. The
+// pose is in the units of the marker size
+struct MarkerRecord {
+        int32_t id;
+        int32_t distance;
+        float corners[4][2];
+        double rvec[3];
+        double tvec[3];
+};
+
+// Markers identified in a frame
+//
+// timestamp_ns is when the frame was captured, in nanoseconds of the
+// system clock. count markers are kept, out of total identified
+struct DetectionRecord {
+        uint64_t frame;
+        int64_t timestamp_ns;
+        uint32_t count;
+        uint32_t total;
+        MarkerRecord markers[RECORD_MAX_MARKERS];
+};
+
+// Slot of the ring
+//
+// sequence is 2n + 1 while record n is being written and 2n + 2 once it
+// is complete. Slots are cache line aligned so that the writer of one
+// slot does not slow down the readers of the next
+struct alignas(64) RingSlot {
+        std::atomic<uint64_t> sequence;
+        DetectionRecord record;
+};
+
+// Start of the shared memory, followed by slot_count slots
+//
+// head is the number of records published. slot_size lets a reader
+// check that it was built with the same layout. state is stored last
+// with release order, and the rest of the header is only read after
+// state is loaded as RING_READY with acquire order
+struct alignas(64) RingHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t slot_size;
+        std::atomic<uint32_t> state;
+        std::atomic<uint64_t> head;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "The ring needs lock free atomics to be shared between processes");
+
+// Single producer of a ring of detections in POSIX shared memory
+//
+// publish never waits: the slot of the oldest record is overwritten
+// whether or not every reader has seen it, so a slow reader can only
+// lose records, never hold the producer. The ring is closed and its name
+// removed when the publisher is destroyed. Readers that have it open keep
+// their mapping and see that it was closed
+class DetectionPublisher {
+public:
+        DetectionPublisher() : header(nullptr), slots(nullptr), size(0), next_sequence(0), device(0), inode(0) {}
+        ~DetectionPublisher();
+
+        // Create the ring, closing and replacing any ring of the same name
+        //
+        // Return false if it cannot be created
+        bool open(const std::string &name, uint32_t slot_count);
+        bool is_open() const { return header != nullptr; }
+
+        void publish(const DetectionRecord &record);
+
+private:
+        std::string name;
+        RingHeader *header;
+        RingSlot *slots;
+        size_t size;
+        uint64_t next_sequence;
+        // Shared memory object of the ring, to only remove the name if it is still ours
+        uint64_t device;
+        uint64_t inode;
+};
+
+// Reader of a ring of detections
+//
+// The ring is mapped read only, so any number of readers can follow it
+// without the producer knowing. A reader starts at the newest record.
+// Records overwritten before the reader got to them are counted as lost.
+// Once the ring is closed no record will follow, and the name has to be
+// opened again to follow the next publisher
+class DetectionReader {
+public:
+        DetectionReader() : header(nullptr), slots(nullptr), size(0), next_sequence(0), lost_records(0) {}
+        ~DetectionReader();
+
+        // Return false if there is no ready ring of that name
+        bool open(const std::string &name);
+        void close();
+
+        // Copy the next record
+        //
+        // Return false if there is no new record yet
+        bool next(DetectionRecord &record);
+
+        uint64_t lost() const { return lost_records; }
+
+        // Whether the publisher of the ring is gone
+        bool closed() const;
+
+private:
+        const RingHeader *header;
+        const RingSlot *slots;
+        size_t size;
+        uint64_t next_sequence;
+        uint64_t lost_records;
+};
+
+#endif
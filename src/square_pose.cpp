@@ -0,0 +1,271 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "square_pose.hpp"
+
+using namespace std;
+
+// Corners of a square of side 1 in its own coordinates, x to the right,
+// y up and z out of the square, in the order of the corners given
+const double SQUARE_MODEL[4][2] = {
+        {-0.5, 0.5}, {0.5, 0.5}, {0.5, -0.5}, {-0.5, -0.5}
+};
+
+void square_translation(const double r[9], const float *corners, double t[3]);
+double square_error(const double r[9], const double t[3], const float *corners);
+void rotation_vector(const double r[9], double rvec[3]);
+
+// Given the corners of n squares of the same side, compute both of their poses
+//
+// This is the infinitesimal plane-based pose estimation (IPPE) of
+// Collins and Bartoli, written out for a square:
+//
+//   The homography from the square to the image is found in closed form
+//   from its 4 corners, as the mapping of the unit square to a
+//   quadrilateral composed with the scale of the model
+//   Its first order approximation at the center of the square, a 2x2
+//   Jacobian, gives the two rotations without any iteration
+//   For each rotation the translation is the linear least squares
+//   solution over the 4 corners, and the reprojection error ranks them
+//
+// The squares are solved in blocks of SQUARE_POSE_BLOCK. Each stage goes
+// over the whole block before the next one starts, and keeps its results
+// in an array per value, so the loops are straight arithmetic on
+// consecutive squares that the compiler can vectorize
+void solve_square_poses(const float *corners, size_t n, double side, SquarePoses *poses) {
+        double u0[SQUARE_POSE_BLOCK], v0[SQUARE_POSE_BLOCK];
+        double j00[SQUARE_POSE_BLOCK], j01[SQUARE_POSE_BLOCK], j10[SQUARE_POSE_BLOCK], j11[SQUARE_POSE_BLOCK];
+        double r1[SQUARE_POSE_BLOCK][9], r2[SQUARE_POSE_BLOCK][9];
+
+        for(size_t first = 0; first < n; first += SQUARE_POSE_BLOCK) {
+                const int count = int(min<size_t>(SQUARE_POSE_BLOCK, n - first));
+                const float *block = corners + 8 * first;
+
+                //
+                // Homography and its Jacobian at the center of the square
+                //
+                for(int i = 0; i < count; ++i) {
+                        const float *p = block + 8 * i;
+                        double x0 = p[0], y0 = p[1], x1 = p[2], y1 = p[3];
+                        double x2 = p[4], y2 = p[5], x3 = p[6], y3 = p[7];
+
+                        // Unit square (0, 0), (1, 0), (1, 1), (0, 1) to the corners
+                        double sx = x0 - x1 + x2 - x3, sy = y0 - y1 + y2 - y3;
+                        double dx1 = x1 - x2, dx2 = x3 - x2, dy1 = y1 - y2, dy2 = y3 - y2;
+                        double den = dx1 * dy2 - dx2 * dy1;
+                        den = den != 0 ? den : DBL_MIN;
+                        double g = (sx * dy2 - dx2 * sy) / den;
+                        double h = (dx1 * sy - sx * dy1) / den;
+                        double a = x1 - x0 + g * x1, b = x3 - x0 + h * x3;
+                        double d = y1 - y0 + g * y1, e = y3 - y0 + h * y3;
+
+                        // The model goes from -0.5 to 0.5 and upwards, so the
+                        // unit square is (x + 0.5, 0.5 - y). The center of the
+                        // model is the center of the unit square
+                        double w = 1 + 0.5 * (g + h);
+                        u0[i] = (0.5 * (a + b) + x0) / w;
+                        v0[i] = (0.5 * (d + e) + y0) / w;
+                        j00[i] = (a - g * u0[i]) / w;
+                        j01[i] = (h * u0[i] - b) / w;
+                        j10[i] = (d - g * v0[i]) / w;
+                        j11[i] = (h * v0[i] - e) / w;
+                }
+
+                //
+                // Both rotations from the Jacobian
+                //
+                for(int i = 0; i < count; ++i) {
+                        // Rotation taking the line of sight of the center
+                        // to the optical axis
+                        double vx = u0[i], vy = v0[i];
+                        double t = sqrt(vx * vx + vy * vy);
+                        double s = sqrt(vx * vx + vy * vy + 1);
+                        double cosine = 1 / s, sine = t / s;
+                        double kx = t > 0 ? vx / t : 0, ky = t > 0 ? vy / t : 0;
+
+                        double rv[9] = {
+                                1 - (1 - cosine) * kx * kx, -(1 - cosine) * kx * ky, sine * kx,
+                                -(1 - cosine) * kx * ky, 1 - (1 - cosine) * ky * ky, sine * ky,
+                                -sine * kx, -sine * ky, cosine
+                        };
+
+                        // B = [I | -v] Rv(:, 0:1) and A = B^-1 J
+                        double b00 = rv[0] - vx * rv[6], b01 = rv[1] - vx * rv[7];
+                        double b10 = rv[3] - vy * rv[6], b11 = rv[4] - vy * rv[7];
+                        double det = b00 * b11 - b01 * b10;
+                        det = det != 0 ? det : DBL_MIN;
+                        double a00 = (b11 * j00[i] - b01 * j10[i]) / det;
+                        double a01 = (b11 * j01[i] - b01 * j11[i]) / det;
+                        double a10 = (b00 * j10[i] - b10 * j00[i]) / det;
+                        double a11 = (b00 * j11[i] - b10 * j01[i]) / det;
+
+                        // Largest singular value of A
+                        double p00 = a00 * a00 + a01 * a01;
+                        double p01 = a00 * a10 + a01 * a11;
+                        double p11 = a10 * a10 + a11 * a11;
+                        double gamma = sqrt(0.5 * (p00 + p11 + sqrt((p00 - p11) * (p00 - p11) + 4 * p01 * p01)));
+                        gamma = gamma > 0 ? gamma : DBL_MIN;
+
+                        double r00 = a00 / gamma, r01 = a01 / gamma, r10 = a10 / gamma, r11 = a11 / gamma;
+                        double h00 = 1 - r00 * r00 - r10 * r10;
+                        double h01 = -r00 * r01 - r10 * r11;
+                        double h11 = 1 - r01 * r01 - r11 * r11;
+                        double c0 = sqrt(max(0.0, h00));
+                        double c1 = sqrt(max(0.0, h11));
+                        c1 = h01 < 0 ? -c1 : c1;
+
+                        // Third column of the rotation in the frame of Rv
+                        double d0 = r10 * c1 - c0 * r11;
+                        double d1 = c0 * r01 - r00 * c1;
+                        double d2 = r00 * r11 - r10 * r01;
+
+                        // R1 = Rv [r c; b a] and R2 = Rv [r -c; -b a]
+                        const double m1[9] = {r00, r01, d0, r10, r11, d1, c0, c1, d2};
+                        const double m2[9] = {r00, r01, -d0, r10, r11, -d1, -c0, -c1, d2};
+                        for(int row = 0; row < 3; ++row) {
+                                for(int col = 0; col < 3; ++col) {
+                                        r1[i][3 * row + col] = rv[3 * row] * m1[col] + rv[3 * row + 1] * m1[3 + col] + rv[3 * row + 2] * m1[6 + col];
+                                        r2[i][3 * row + col] = rv[3 * row] * m2[col] + rv[3 * row + 1] * m2[3 + col] + rv[3 * row + 2] * m2[6 + col];
+                                }
+                        }
+                }
+
+                //
+                // Translations, errors and rotation vectors
+                //
+                for(int i = 0; i < count; ++i) {
+                        const float *p = block + 8 * i;
+                        SquarePoses &pose = poses[first + i];
+
+                        double t1[3], t2[3];
+                        square_translation(r1[i], p, t1);
+                        square_translation(r2[i], p, t2);
+                        double e1 = square_error(r1[i], t1, p);
+                        double e2 = square_error(r2[i], t2, p);
+
+                        bool swapped = e2 < e1;
+                        SquarePose &best = pose.solutions[swapped ? 1 : 0];
+                        SquarePose &other = pose.solutions[swapped ? 0 : 1];
+
+                        rotation_vector(r1[i], best.rvec);
+                        rotation_vector(r2[i], other.rvec);
+                        for(int k = 0; k < 3; ++k) {
+                                best.tvec[k] = t1[k] * side;
+                                other.tvec[k] = t2[k] * side;
+                        }
+                        best.error = e1;
+                        other.error = e2;
+                }
+        }
+}
+
+// Given a rotation, compute the translation of a square of side 1
+//
+// Each corner projected with the rotation and translation t must land on
+// its image (u, v), which is linear in t:
+//
+//   tx - u tz = u (r20 x + r21 y) - (r00 x + r01 y)
+//   ty - v tz = v (r20 x + r21 y) - (r10 x + r11 y)
+//
+// The normal equations of the 8 equations are solved in closed form
+void square_translation(const double r[9], const float *corners, double t[3]) {
+        double su = 0, sv = 0, suv = 0, b0 = 0, b1 = 0, b2 = 0;
+
+        for(int k = 0; k < 4; ++k) {
+                double x = SQUARE_MODEL[k][0], y = SQUARE_MODEL[k][1];
+                double u = corners[2 * k], v = corners[2 * k + 1];
+                double depth = r[6] * x + r[7] * y;
+                double eu = u * depth - (r[0] * x + r[1] * y);
+                double ev = v * depth - (r[3] * x + r[4] * y);
+
+                su += u;
+                sv += v;
+                suv += u * u + v * v;
+                b0 += eu;
+                b1 += ev;
+                b2 -= u * eu + v * ev;
+        }
+
+        // With tx = (b0 + su tz) / 4 and ty = (b1 + sv tz) / 4 the last
+        // equation is left with tz only
+        double den = suv - (su * su + sv * sv) / 4;
+        t[2] = den != 0 ? (b2 + (su * b0 + sv * b1) / 4) / den : 0;
+        t[0] = (b0 + su * t[2]) / 4;
+        t[1] = (b1 + sv * t[2]) / 4;
+}
+
+// Root mean square distance between the corners and the reprojection of the square
+//
+// A square behind the camera has an infinite error
+double square_error(const double r[9], const double t[3], const float *corners) {
+        double sum = 0;
+
+        for(int k = 0; k < 4; ++k) {
+                double x = SQUARE_MODEL[k][0], y = SQUARE_MODEL[k][1];
+                double px = r[0] * x + r[1] * y + t[0];
+                double py = r[3] * x + r[4] * y + t[1];
+                double pz = r[6] * x + r[7] * y + t[2];
+                if (pz <= 0) return HUGE_VAL;
+
+                double du = px / pz - corners[2 * k];
+                double dv = py / pz - corners[2 * k + 1];
+                sum += du * du + dv * dv;
+        }
+        return sqrt(sum / 4);
+}
+
+// Given a rotation matrix, compute its axis scaled by the angle
+//
+// Same as Rodrigues. Close to half a turn the axis is taken from the
+// diagonal, as the antisymmetric part of the matrix vanishes
+void rotation_vector(const double r[9], double rvec[3]) {
+        double rx = r[7] - r[5], ry = r[2] - r[6], rz = r[3] - r[1];
+        double s = 0.5 * sqrt(rx * rx + ry * ry + rz * rz);
+        double c = max(-1.0, min(1.0, 0.5 * (r[0] + r[4] + r[8] - 1)));
+
+        if (s < 1e-5) {
+                if (c > 0) {
+                        rvec[0] = rvec[1] = rvec[2] = 0;
+                        return;
+                }
+
+                double ax = sqrt(max(0.0, 0.5 * (r[0] + 1)));
+                double ay = sqrt(max(0.0, 0.5 * (r[4] + 1))) * (r[1] < 0 ? -1 : 1);
+                double az = sqrt(max(0.0, 0.5 * (r[8] + 1))) * (r[2] < 0 ? -1 : 1);
+                if (fabs(ax) < fabs(ay) && fabs(ax) < fabs(az) && (r[5] > 0) != (ay * az > 0))
+                        az = -az;
+
+                double scale = acos(c) / sqrt(ax * ax + ay * ay + az * az);
+                rvec[0] = ax * scale;
+                rvec[1] = ay * scale;
+                rvec[2] = az * scale;
+                return;
+        }
+
+        double scale = atan2(s, c) / (2 * s);
+        rvec[0] = rx * scale;
+        rvec[1] = ry * scale;
+        rvec[2] = rz * scale;
+}
+
+// Given a rotation vector, compute where it takes the z axis
+//
+// That is the normal of a marker with that rotation, which tells apart
+// the two poses of a square
+void rvec_normal(const double rvec[3], double normal[3]) {
+        double theta = sqrt(rvec[0] * rvec[0] + rvec[1] * rvec[1] + rvec[2] * rvec[2]);
+        if (theta < 1e-12) {
+                normal[0] = normal[1] = 0;
+                normal[2] = 1;
+                return;
+        }
+
+        double kx = rvec[0] / theta, ky = rvec[1] / theta, kz = rvec[2] / theta;
+        double c = cos(theta), s = sin(theta);
+
+        // Rodrigues formula applied to (0, 0, 1)
+        normal[0] = s * ky + (1 - c) * kx * kz;
+        normal[1] = -s * kx + (1 - c) * ky * kz;
+        normal[2] = c + (1 - c) * kz * kz;
+}
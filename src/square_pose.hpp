@@ -0,0 +1,40 @@
+#ifndef _SQUARE_POSE_H
+#define _SQUARE_POSE_H
+
+#include <cstddef>
+
+// Markers solved together in each pass of solve_square_poses
+#define SQUARE_POSE_BLOCK 16
+
+// Pose of a square marker with respect to the camera
+//
+// rvec is the rotation as an axis scaled by the angle, tvec the
+// translation in the units of the side of the marker. error is the root
+// mean square distance between the corners and their reprojection, in
+// normalized image coordinates
+struct SquarePose {
+        double rvec[3];
+        double tvec[3];
+        double error;
+};
+
+// Both poses of a square that agree with its image
+//
+// A square seen in perspective may be tilted towards the camera or away
+// from it by about the same angle. The two poses are told apart by their
+// reprojection error, which is small for both when the marker is far or
+// seen straight on. The first one has the smallest error
+struct SquarePoses {
+        SquarePose solutions[2];
+};
+
+// Given the corners of n squares of the same side, compute both of their poses
+//
+// The corners are 4 points (x, y) per square in normalized image
+// coordinates, that is undistorted and divided by the focal length, in
+// the order top left, top right, bottom right and bottom left of the
+// square seen from its front
+void solve_square_poses(const float *corners, size_t n, double side, SquarePoses *poses);
+void rvec_normal(const double rvec[3], double normal[3]);
+
+#endif
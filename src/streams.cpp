@@ -0,0 +1,216 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include "streams.hpp"
+#include "trace.hpp"
+
+using namespace std::chrono;
+
+Stream::Stream(const StreamConfig &config, size_t depth)
+        : config(config), pool(depth), pending(depth, nullptr), next_index(0), frames(0), dropped(0) {}
+
+// Read the streams of a manifest file
+//
+// Every line is a stream: input [output [block|drop]]
+// Empty lines and lines starting with # are skipped. Streams without
+// an output are left for the caller to name, and without a policy they
+// drop frames if the input is a camera number.
+// Return false if the file cannot be read or a policy is not known
+bool read_manifest(const string &filename, vector<StreamConfig> &configs) {
+        ifstream is(filename);
+        if (!is.is_open()) return false;
+
+        string line;
+        while(getline(is, line)) {
+                istringstream fields(line);
+                StreamConfig config;
+                string policy;
+
+                if (!(fields >> config.input) || config.input[0] == '#') continue;
+                fields >> config.output >> policy;
+
+                if (policy == "drop")
+                        config.policy = DropPolicy::Drop;
+                else if (policy == "block")
+                        config.policy = DropPolicy::Block;
+                else if (policy == "")
+                        config.policy = is_camera(config.input) ? DropPolicy::Drop : DropPolicy::Block;
+                else
+                        return false;
+
+                configs.push_back(config);
+        }
+        return true;
+}
+
+// Return true if the input is the number of a camera
+bool is_camera(const string &input) {
+        return !input.empty() && input.find_first_not_of("0123456789") == string::npos;
+}
+
+// Open the input and the detections file of a stream
+//
+// Return false if either cannot be opened
+bool open_stream(Stream &stream) {
+        const string &input = stream.config.input;
+
+        if (is_camera(input))
+                stream.capture.open(stoi(input));
+        else
+                stream.capture.open(input);
+        if (!stream.capture.isOpened()) return false;
+
+        if (stream.config.output != "") {
+                stream.output.open(stream.config.output);
+                if (!stream.output.is_open()) return false;
+        }
+        return true;
+}
+
+// Process every stream on a single pool of workers until they end
+//
+// Each stream has its own capture thread, which hands every frame to
+// the pool as a task. The streams must be open
+void run_streams(vector<unique_ptr<Stream> > &streams, const EngineOptions &options, atomic<bool> &running) {
+        StreamContext context;
+        load_decoding_table(context.decoding_table, options.dictionary, options.tolerance);
+        context.camera = options.camera;
+        context.pyramid_level = options.pyramid_level;
+
+        WorkStealingPool workers(options.workers);
+        context.scratch.resize(workers.size());
+
+        high_resolution_clock::time_point start_t = high_resolution_clock::now();
+        for(auto &stream : streams) {
+                stream->start_t = start_t;
+                stream->last_t = start_t;
+        }
+
+        vector<thread> captures;
+        for(auto &stream : streams) {
+                captures.push_back(thread(capture_stream, ref(*stream), ref(workers), ref(context), ref(running)));
+        }
+
+        // Print the stats every stats_interval seconds until the streams end
+        atomic<bool> reporting(true);
+        thread reporter;
+        if (options.stats_interval > 0) {
+                reporter = thread([&] {
+                        high_resolution_clock::time_point last_t = high_resolution_clock::now();
+                        while(reporting) {
+                                this_thread::sleep_for(milliseconds(100));
+                                if (high_resolution_clock::now() - last_t >= seconds(options.stats_interval)) {
+                                        last_t = high_resolution_clock::now();
+                                        print_stream_stats(cout, streams);
+                                }
+                        }
+                });
+        }
+
+        for(auto &t : captures) t.join();
+        workers.shutdown();
+
+        reporting = false;
+        if (reporter.joinable())
+                reporter.join();
+}
+
+// Read the frames of a stream and queue their detection on the pool
+//
+// The pool of frames of the stream gives the backpressure: once every
+// frame is in flight the capture waits for one or, if the stream drops
+// frames, skips the new one
+void capture_stream(Stream &stream, WorkStealingPool &workers, StreamContext &context, atomic<bool> &running) {
+        uint64_t index = 0;
+
+        while(running) {
+                Frame *frame = stream.config.policy == DropPolicy::Drop
+                        ? stream.pool.try_acquire() : stream.pool.acquire();
+
+                if (frame == nullptr) {
+                        if (!stream.capture.grab()) break;
+                        stream.dropped++;
+                        continue;
+                }
+
+                if (!stream.capture.read(frame->image)) {
+                        stream.pool.release(frame);
+                        break;
+                }
+                frame->captured = high_resolution_clock::now();
+                frame->index = index++;
+
+                workers.submit([&stream, &context, frame](int worker) {
+                        detect_stream_frame(*frame, context.scratch[worker], context);
+                        finish_stream_frame(stream, frame);
+                });
+        }
+}
+
+// Find, decode and locate the markers of a frame
+void detect_stream_frame(Frame &frame, DetectScratch &scratch, const StreamContext &context) {
+        trace_frame(frame.index);
+
+        prepare_frame(frame);
+        find_markers(frame, context.pyramid_level, scratch);
+        decode_markers(frame, context.decoding_table);
+        estimate_poses(frame, context.camera, nullptr, scratch.pose);
+        frame.decoded = true;
+}
+
+// Write the frames of the stream that are done, in order, and give them
+// back to its pool
+void finish_stream_frame(Stream &stream, Frame *frame) {
+        lock_guard<mutex> lock(stream.mtx);
+
+        const size_t depth = stream.pending.size();
+        stream.pending[frame->index % depth] = frame;
+
+        while(stream.pending[stream.next_index % depth] != nullptr) {
+                Frame *done = stream.pending[stream.next_index % depth];
+                stream.pending[stream.next_index % depth] = nullptr;
+                stream.next_index++;
+
+                if (stream.output.is_open())
+                        write_detections(stream.output, *done);
+
+                stream.latency.record(elapsed_ns(done->captured));
+                stream.last_t = high_resolution_clock::now();
+                stream.frames++;
+
+                stream.pool.release(done);
+        }
+}
+
+// Print the throughput and the latency of every stream, in ms
+//
+// The throughput is measured until the last frame of the stream
+void print_stream_stats(ostream &os, vector<unique_ptr<Stream> > &streams) {
+        streamsize precision = os.precision();
+        os << "  stream  frames dropped     fps     p50     p95     p99     max  input" << endl;
+
+        for(size_t s = 0; s < streams.size(); ++s) {
+                Stream &stream = *streams[s];
+
+                double seconds;
+                {
+                        lock_guard<mutex> lock(stream.mtx);
+                        seconds = duration<double>(stream.last_t - stream.start_t).count();
+                }
+                uint64_t frames = stream.frames;
+                const LatencyHistogram &h = stream.latency;
+
+                os << "  " << left << setw(6) << s << right << fixed
+                   << setw(8) << frames
+                   << setw(8) << stream.dropped.load() << setprecision(1)
+                   << setw(8) << (seconds > 0 ? frames / seconds : 0.0) << setprecision(2)
+                   << setw(8) << h.percentile(0.50) / 1e6
+                   << setw(8) << h.percentile(0.95) / 1e6
+                   << setw(8) << h.percentile(0.99) / 1e6
+                   << setw(8) << h.max_ns() / 1e6
+                   << "  " << stream.config.input << endl;
+        }
+        os << defaultfloat << setprecision(precision);
+}
@@ -0,0 +1,84 @@
+#ifndef _STREAMS_H
+#define _STREAMS_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <ostream>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "detector.hpp"
+#include "pipeline.hpp"
+#include "latency.hpp"
+#include "work_pool.hpp"
+
+// Input, detections file and drop policy of a stream
+struct StreamConfig {
+        string input;
+        string output;
+        DropPolicy policy;
+};
+
+// Stream being processed by the engine
+//
+// The frames of a stream are detected by any worker of the pool and may
+// finish in any order. The worker that finishes the next frame in order
+// writes it, and the following frames already done, so the detections
+// keep the order of the input. There are never more than depth frames
+// in flight, so a frame waits in the slot given by its index modulo depth.
+// The index only counts the frames that were not dropped
+struct Stream {
+        Stream(const StreamConfig &config, size_t depth);
+
+        StreamConfig config;
+        VideoCapture capture;
+        ofstream output;
+        FramePool<Frame> pool;
+
+        // Guards the pending frames, the output and the time of the last frame
+        std::mutex mtx;
+        vector<Frame *> pending;
+        uint64_t next_index;
+        std::chrono::high_resolution_clock::time_point start_t;
+        std::chrono::high_resolution_clock::time_point last_t;
+
+        std::atomic<uint64_t> frames;
+        std::atomic<uint64_t> dropped;
+        // From the capture of a frame until its detections are written
+        LatencyHistogram latency;
+};
+
+// Settings shared by every stream
+struct EngineOptions {
+        Camera camera;
+        int tolerance;
+        string dictionary;
+        int pyramid_level;
+        int workers;
+        int stats_interval;
+};
+
+// Read-only data of the detection and the buffers of each worker
+struct StreamContext {
+        DecodingTable decoding_table;
+        Camera camera;
+        int pyramid_level;
+        vector<DetectScratch> scratch;
+};
+
+bool is_camera(const string &input);
+bool read_manifest(const string &filename, vector<StreamConfig> &configs);
+bool open_stream(Stream &stream);
+void run_streams(vector<unique_ptr<Stream> > &streams, const EngineOptions &options, std::atomic<bool> &running);
+void capture_stream(Stream &stream, WorkStealingPool &workers, StreamContext &context, std::atomic<bool> &running);
+void detect_stream_frame(Frame &frame, DetectScratch &scratch, const StreamContext &context);
+void finish_stream_frame(Stream &stream, Frame *frame);
+void print_stream_stats(ostream &os, vector<unique_ptr<Stream> > &streams);
+
+#endif
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <opencv2/core/utility.hpp>
+
+#include "detector.hpp"
+#include "streams.hpp"
+
+using namespace std::chrono;
+
+vector<string> repeated_option(int argc, char **argv, const string &name);
+
+// Detect the markers of several cameras or video files at once
+//
+// Every stream has its own capture thread and detections file, but the
+// detection of the frames of all of them runs on a single pool of
+// workers. The streams are given by repeating input or in a manifest
+int main(int argc, char **argv) {
+
+        const String keys =
+        "{help h usage ? |          | Print this message }"
+        "{input          |          | Video file or camera number. Repeat it for every stream }"
+        "{manifest       |          | File with a stream per line: input [output [block|drop]] }"
+        "{c              |<none>    | Camera calibration file }"
+        "{out            |.         | Directory of the detections of the streams given with input }"
+        "{tolerance      |1         | Number of wrong bits accepted when reading a marker }"
+        "{dictionary     |          | Dictionary file written by gen_dictionary (empty = the dictionary built in) }"
+        "{size           |1         | Side of the markers. The translation of the markers is given in the same units }"
+        "{pyramid        |0         | Look for markers in the frame halved this many times (0 = full resolution) }"
+        "{workers        |0         | Threads shared by every stream (0 = one per core) }"
+        "{depth          |4         | Frames of each stream in flight }"
+        "{drop           |          | Drop frames of video files too when the workers fall behind (cameras always do) }"
+        "{stats          |0         | Print the stats of the streams every this many seconds (0 = only at the end) }";
+
+        CommandLineParser cmdParser(argc, argv, keys);
+
+        if (cmdParser.has("help"))
+        {
+                cmdParser.printMessage();
+                return 0;
+        }
+
+        vector<StreamConfig> configs;
+
+        String manifest = cmdParser.get<String>("manifest");
+        if (manifest != "" && !read_manifest(manifest, configs)) {
+                cerr << "Cannot read the manifest \"" + manifest + "\"" << endl;
+                return -1;
+        }
+
+        for(auto &input : repeated_option(argc, argv, "input")) {
+                StreamConfig config;
+                config.input = input;
+                config.policy = is_camera(input) ? DropPolicy::Drop : DropPolicy::Block;
+                configs.push_back(config);
+        }
+
+        if (configs.empty()) {
+                cerr << "No streams given, use input or manifest" << endl;
+                return -1;
+        }
+
+        String out_dir = cmdParser.get<String>("out");
+        bool drop = cmdParser.has("drop");
+        for(size_t s = 0; s < configs.size(); ++s) {
+                if (configs[s].output == "")
+                        configs[s].output = out_dir + "/stream" + std::to_string(s) + ".jsonl";
+                if (drop)
+                        configs[s].policy = DropPolicy::Drop;
+        }
+
+        EngineOptions options;
+        options.camera.marker_size = cmdParser.get<double>("size");
+        calibrate_camera(cmdParser.get<String>("c"), options.camera.camMatrix, options.camera.distCoeffs);
+        options.tolerance = cmdParser.get<int>("tolerance");
+        options.dictionary = cmdParser.get<String>("dictionary");
+        options.pyramid_level = max(0, cmdParser.get<int>("pyramid"));
+        options.stats_interval = cmdParser.get<int>("stats");
+        options.workers = cmdParser.get<int>("workers");
+        if (options.workers <= 0)
+                options.workers = max(1u, thread::hardware_concurrency());
+
+        size_t depth = max(1, cmdParser.get<int>("depth"));
+
+        vector<unique_ptr<Stream> > streams;
+        for(auto &config : configs) {
+                streams.emplace_back(new Stream(config, depth));
+                if (!open_stream(*streams.back())) {
+                        cerr << "Cannot open the stream \"" + config.input + "\" or its output \"" + config.output + "\"" << endl;
+                        return -1;
+                }
+                cout << "Stream " << streams.size() - 1 << ": " << config.input << " -> " << config.output << endl;
+        }
+
+        atomic<bool> running(true);
+        high_resolution_clock::time_point start_t = high_resolution_clock::now();
+
+        run_streams(streams, options, running);
+
+        duration<double> total_time = high_resolution_clock::now() - start_t;
+        uint64_t frames = 0;
+        for(auto &stream : streams) frames += stream->frames;
+
+        cout << "Processed " << frames << " frames of " << streams.size() << " streams in "
+             << total_time.count() << " s (" << frames / total_time.count() << " fps)" << endl;
+        print_stream_stats(cout, streams);
+}
+
+// Every value given to an option that can be repeated
+//
+// CommandLineParser only keeps the last one, so the arguments are read
+// directly. Both -name=value and --name=value are accepted
+vector<string> repeated_option(int argc, char **argv, const string &name) {
+        vector<string> values;
+
+        for(int a = 1; a < argc; ++a) {
+                string arg = argv[a];
+                size_t dashes = arg.find_first_not_of('-');
+                if (dashes == 0 || dashes > 2) continue;
+
+                if (arg.compare(dashes, name.size() + 1, name + "=") == 0)
+                        values.push_back(arg.substr(dashes + name.size() + 1));
+        }
+        return values;
+}
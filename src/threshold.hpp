@@ -0,0 +1,364 @@
+#ifndef _THRESHOLD_H
+#define _THRESHOLD_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Parameters of the adaptive threshold of the detector. They are fixed
+// at compile time so that the kernels are specialized for them
+#define THRESH_BLOCK_SIZE 21
+#define THRESH_C 7
+
+// Fused gray scale conversion and adaptive threshold
+//
+// Computes in a single pass over the frame the same result as
+//
+//   cvtColor(bgr, gray, CV_BGR2GRAY);
+//   adaptiveThreshold(gray, bw, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, BLOCK_SIZE, DELTA);
+//
+// The gray rows are produced just ahead of the rows being thresholded,
+// so the window of BLOCK_SIZE rows used by the box filter is still in
+// cache when it is read back. The vertical sums of the window are kept
+// per column and updated with one row in and one row out.
+//
+// The result matches OpenCV 3.x bit for bit:
+//   gray = (1868 B + 9617 G + 4899 R + 2^13) >> 14, as in cvtColor
+//   mean = round(sum / BLOCK_SIZE^2) with replicated borders, as in boxFilter
+//   bw   = gray <= mean - DELTA ? 255 : 0
+// OpenCV builds that use other gray coefficients may differ by one gray
+// level on some pixels, and so on the pixels of bw that sit exactly on
+// the threshold.
+//
+// AVX2 and NEON are used when the compiler targets them. Otherwise the
+// plain loops are left to the auto vectorizer.
+
+// Scratch buffers of the kernel. Reusing them avoids allocating on every frame
+struct ThresholdScratch {
+        std::vector<uint16_t> colsum;
+        std::vector<uint16_t> window;
+};
+
+namespace threshold_detail {
+
+// Largest divisor of the block whose partial sums still fit in 16 bits
+constexpr int partial_window(int block, int size) {
+        return (block % size == 0 && size * block * 255 <= 65535) ? size : partial_window(block, size - 1);
+}
+
+// Gray scale conversion of one row of BGR pixels
+inline void gray_row(const uint8_t *bgr, uint8_t *gray, int width) {
+        int x = 0;
+
+#if defined(__AVX2__)
+        // Deinterleave 16 pixels at a time into B, G and R
+        const __m128i b0 = _mm_setr_epi8( 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1);
+        const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13);
+        const __m128i g0 = _mm_setr_epi8( 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1);
+        const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14);
+        const __m128i r0 = _mm_setr_epi8( 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1);
+        const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15);
+
+        // Pairs (B, G) and (R, 1) are multiplied and added in 32 bits
+        const __m128i coeffs_bg = _mm_setr_epi16(1868, 9617, 1868, 9617, 1868, 9617, 1868, 9617);
+        const __m128i coeffs_r1 = _mm_setr_epi16(4899, 8192, 4899, 8192, 4899, 8192, 4899, 8192);
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i zero = _mm_setzero_si128();
+
+        for(; x + 16 <= width; x += 16) {
+                __m128i v0 = _mm_loadu_si128((const __m128i *)(bgr + 3 * x));
+                __m128i v1 = _mm_loadu_si128((const __m128i *)(bgr + 3 * x + 16));
+                __m128i v2 = _mm_loadu_si128((const __m128i *)(bgr + 3 * x + 32));
+
+                __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1)), _mm_shuffle_epi8(v2, b2));
+                __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1)), _mm_shuffle_epi8(v2, g2));
+                __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1)), _mm_shuffle_epi8(v2, r2));
+
+                __m128i y16[2];
+                for(int half = 0; half < 2; ++half) {
+                        __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+                        __m128i g16 = half ? _mm_unpackhi_epi8(g, zero) : _mm_unpacklo_epi8(g, zero);
+                        __m128i r16 = half ? _mm_unpackhi_epi8(r, zero) : _mm_unpacklo_epi8(r, zero);
+
+                        __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b16, g16), coeffs_bg),
+                                                   _mm_madd_epi16(_mm_unpacklo_epi16(r16, ones), coeffs_r1));
+                        __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b16, g16), coeffs_bg),
+                                                   _mm_madd_epi16(_mm_unpackhi_epi16(r16, ones), coeffs_r1));
+
+                        y16[half] = _mm_packs_epi32(_mm_srli_epi32(lo, 14), _mm_srli_epi32(hi, 14));
+                }
+
+                _mm_storeu_si128((__m128i *)(gray + x), _mm_packus_epi16(y16[0], y16[1]));
+        }
+#elif defined(__ARM_NEON)
+        for(; x + 8 <= width; x += 8) {
+                uint8x8x3_t v = vld3_u8(bgr + 3 * x);
+                uint16x8_t b = vmovl_u8(v.val[0]);
+                uint16x8_t g = vmovl_u8(v.val[1]);
+                uint16x8_t r = vmovl_u8(v.val[2]);
+
+                uint32x4_t lo = vmull_n_u16(vget_low_u16(b), 1868);
+                lo = vmlal_n_u16(lo, vget_low_u16(g), 9617);
+                lo = vmlal_n_u16(lo, vget_low_u16(r), 4899);
+                uint32x4_t hi = vmull_n_u16(vget_high_u16(b), 1868);
+                hi = vmlal_n_u16(hi, vget_high_u16(g), 9617);
+                hi = vmlal_n_u16(hi, vget_high_u16(r), 4899);
+
+                // Rounding shift adds the 2^13 of the formula
+                uint16x8_t y = vcombine_u16(vrshrn_n_u32(lo, 14), vrshrn_n_u32(hi, 14));
+                vst1_u8(gray + x, vmovn_u16(y));
+        }
+#endif
+
+        for(; x < width; ++x) {
+                const uint8_t *p = bgr + 3 * x;
+                gray[x] = uint8_t((1868 * p[0] + 9617 * p[1] + 4899 * p[2] + (1 << 13)) >> 14);
+        }
+}
+
+// Add one gray row to the column sums and remove another
+inline void update_colsum(uint16_t *colsum, const uint8_t *row_in, const uint8_t *row_out, int width) {
+        int x = 0;
+
+#if defined(__AVX2__)
+        for(; x + 16 <= width; x += 16) {
+                __m256i sum = _mm256_loadu_si256((const __m256i *)(colsum + x));
+                __m256i in = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row_in + x)));
+                __m256i out = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row_out + x)));
+                _mm256_storeu_si256((__m256i *)(colsum + x), _mm256_sub_epi16(_mm256_add_epi16(sum, in), out));
+        }
+#elif defined(__ARM_NEON)
+        for(; x + 8 <= width; x += 8) {
+                uint16x8_t sum = vld1q_u16(colsum + x);
+                sum = vsubw_u8(vaddw_u8(sum, vld1_u8(row_in + x)), vld1_u8(row_out + x));
+                vst1q_u16(colsum + x, sum);
+        }
+#endif
+
+        for(; x < width; ++x) {
+                colsum[x] = uint16_t(colsum[x] + row_in[x] - row_out[x]);
+        }
+}
+
+// Sums of SIZE consecutive column sums
+//
+// window[i] = colsum[i] + ... + colsum[i + SIZE - 1] for i < count
+template<int SIZE>
+inline void window_sums(const uint16_t *colsum, uint16_t *window, int count) {
+        int i = 0;
+
+#if defined(__AVX2__)
+        for(; i + 16 <= count; i += 16) {
+                __m256i sum = _mm256_loadu_si256((const __m256i *)(colsum + i));
+                for(int k = 1; k < SIZE; ++k)
+                        sum = _mm256_add_epi16(sum, _mm256_loadu_si256((const __m256i *)(colsum + i + k)));
+                _mm256_storeu_si256((__m256i *)(window + i), sum);
+        }
+#elif defined(__ARM_NEON)
+        for(; i + 8 <= count; i += 8) {
+                uint16x8_t sum = vld1q_u16(colsum + i);
+                for(int k = 1; k < SIZE; ++k)
+                        sum = vaddq_u16(sum, vld1q_u16(colsum + i + k));
+                vst1q_u16(window + i, sum);
+        }
+#endif
+
+        for(; i < count; ++i) {
+                uint16_t sum = 0;
+                for(int k = 0; k < SIZE; ++k)
+                        sum = uint16_t(sum + colsum[i + k]);
+                window[i] = sum;
+        }
+}
+
+// Compare each gray pixel with the mean of its block
+//
+// The block sum is made of PARTS windows of SIZE columns. To avoid the
+// division, gray + DELTA <= round(sum / AREA) is evaluated as
+// (gray + DELTA) * AREA <= sum + AREA / 2, which is exact for an odd AREA
+template<int SIZE, int PARTS, int DELTA>
+inline void threshold_row(const uint16_t *window, const uint8_t *gray, uint8_t *bw, int width) {
+        const int AREA = (SIZE * PARTS) * (SIZE * PARTS);
+        int x = 0;
+
+#if defined(__AVX2__)
+        const __m256i area = _mm256_set1_epi32(AREA);
+        const __m256i half = _mm256_set1_epi32(AREA / 2);
+        const __m256i delta = _mm256_set1_epi32(DELTA);
+        const __m128i ones = _mm_set1_epi8(-1);
+
+        for(; x + 16 <= width; x += 16) {
+                __m256i gt[2];
+
+                for(int h = 0; h < 2; ++h) {
+                        int p = x + 8 * h;
+                        __m256i sum = half;
+                        for(int k = 0; k < PARTS; ++k)
+                                sum = _mm256_add_epi32(sum, _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(window + p + k * SIZE))));
+
+                        __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(gray + p)));
+                        __m256i lhs = _mm256_mullo_epi32(_mm256_add_epi32(g, delta), area);
+                        gt[h] = _mm256_cmpgt_epi32(lhs, sum);
+                }
+
+                // Narrow the 32 bit masks to bytes keeping the pixel order
+                __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(gt[0], gt[1]), 0xD8);
+                __m128i mask = _mm_packs_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+                _mm_storeu_si128((__m128i *)(bw + x), _mm_xor_si128(mask, ones));
+        }
+#elif defined(__ARM_NEON)
+        for(; x + 8 <= width; x += 8) {
+                uint16x8_t g = vaddq_u16(vmovl_u8(vld1_u8(gray + x)), vdupq_n_u16(DELTA));
+                uint32x4_t lo = vdupq_n_u32(AREA / 2);
+                uint32x4_t hi = vdupq_n_u32(AREA / 2);
+                for(int k = 0; k < PARTS; ++k) {
+                        uint16x8_t w = vld1q_u16(window + x + k * SIZE);
+                        lo = vaddw_u16(lo, vget_low_u16(w));
+                        hi = vaddw_u16(hi, vget_high_u16(w));
+                }
+
+                uint32x4_t le_lo = vcleq_u32(vmull_n_u16(vget_low_u16(g), AREA), lo);
+                uint32x4_t le_hi = vcleq_u32(vmull_n_u16(vget_high_u16(g), AREA), hi);
+                uint16x8_t mask = vcombine_u16(vmovn_u32(le_lo), vmovn_u32(le_hi));
+                vst1_u8(bw + x, vmovn_u16(mask));
+        }
+#endif
+
+        for(; x < width; ++x) {
+                int sum = AREA / 2;
+                for(int k = 0; k < PARTS; ++k)
+                        sum += window[x + k * SIZE];
+                bw[x] = (gray[x] + DELTA) * AREA <= sum ? 255 : 0;
+        }
+}
+
+// Threshold a gray image, converting it from BGR first if bgr is given
+//
+// When converting, each gray row is written to gray_out just before the
+// box filter needs it. gray and gray_out are then the same image
+template<int BLOCK_SIZE, int DELTA>
+void threshold_pass(const uint8_t *bgr, size_t bgr_step,
+                    uint8_t *gray_out, const uint8_t *gray, size_t gray_step,
+                    uint8_t *bw, size_t bw_step,
+                    int width, int height, ThresholdScratch &scratch) {
+        static_assert(BLOCK_SIZE % 2 == 1 && BLOCK_SIZE > 1, "The block size must be odd");
+        static_assert(BLOCK_SIZE * 255 <= 65535, "The column sums must fit in 16 bits");
+        static_assert(DELTA >= 0, "Only non negative deltas are supported");
+
+        const int RADIUS = BLOCK_SIZE / 2;
+        const int SIZE = partial_window(BLOCK_SIZE, BLOCK_SIZE);
+        const int PARTS = BLOCK_SIZE / SIZE;
+
+        if (width <= 0 || height <= 0) return;
+
+        // The column sums are stored with RADIUS replicated values on each side
+        scratch.colsum.assign(width + 2 * RADIUS, 0);
+        scratch.window.resize(width + BLOCK_SIZE - SIZE);
+        uint16_t *colsum = scratch.colsum.data() + RADIUS;
+
+        // Row of the image with replicated borders
+        auto gray_at = [&](int y) {
+                return gray + size_t(std::min(std::max(y, 0), height - 1)) * gray_step;
+        };
+
+        // Convert the row if the input is BGR
+        auto convert = [&](int y) {
+                if (bgr != nullptr)
+                        gray_row(bgr + size_t(y) * bgr_step, gray_out + size_t(y) * gray_step, width);
+        };
+
+        // Rows above the first one are copies of it
+        convert(0);
+        for(int x = 0; x < width; ++x)
+                colsum[x] = uint16_t((RADIUS + 1) * gray[x]);
+
+        int ready = 1;
+        for(int y = 1; y <= RADIUS; ++y) {
+                if (y < height) {
+                        convert(y);
+                        ready = y + 1;
+                }
+                const uint8_t *row = gray_at(y);
+                for(int x = 0; x < width; ++x)
+                        colsum[x] = uint16_t(colsum[x] + row[x]);
+        }
+
+        for(int y = 0; y < height; ++y) {
+                for(int x = 0; x < RADIUS; ++x) {
+                        colsum[-1 - x] = colsum[0];
+                        colsum[width + x] = colsum[width - 1];
+                }
+
+                window_sums<SIZE>(scratch.colsum.data(), scratch.window.data(), int(scratch.window.size()));
+                threshold_row<SIZE, PARTS, DELTA>(scratch.window.data(), gray_at(y), bw + size_t(y) * bw_step, width);
+
+                if (y + 1 == height) break;
+
+                // Slide the window one row down
+                int next = y + 1 + RADIUS;
+                if (next < height && next >= ready) {
+                        convert(next);
+                        ready = next + 1;
+                }
+                update_colsum(colsum, gray_at(next), gray_at(y - RADIUS), width);
+        }
+}
+
+} // namespace threshold_detail
+
+// Convert a BGR image to gray and threshold it with the mean of a
+// BLOCK_SIZE x BLOCK_SIZE neighbourhood minus DELTA
+//
+// Both gray and bw must have room for width x height pixels
+template<int BLOCK_SIZE, int DELTA>
+void gray_adaptive_threshold(const uint8_t *bgr, size_t bgr_step,
+                             uint8_t *gray, size_t gray_step,
+                             uint8_t *bw, size_t bw_step,
+                             int width, int height, ThresholdScratch &scratch) {
+        threshold_detail::threshold_pass<BLOCK_SIZE, DELTA>(bgr, bgr_step, gray, gray, gray_step,
+                bw, bw_step, width, height, scratch);
+}
+
+// Same threshold for an image that is already gray
+template<int BLOCK_SIZE, int DELTA>
+void adaptive_threshold(const uint8_t *gray, size_t gray_step,
+                        uint8_t *bw, size_t bw_step,
+                        int width, int height, ThresholdScratch &scratch) {
+        threshold_detail::threshold_pass<BLOCK_SIZE, DELTA>(nullptr, 0, nullptr, gray, gray_step,
+                bw, bw_step, width, height, scratch);
+}
+
+// Gray scale conversion alone, with the same coefficients
+inline void bgr_to_gray(const uint8_t *bgr, size_t bgr_step,
+                        uint8_t *gray, size_t gray_step,
+                        int width, int height) {
+        for(int y = 0; y < height; ++y)
+                threshold_detail::gray_row(bgr + size_t(y) * bgr_step, gray + size_t(y) * gray_step, width);
+}
+
+// Luma of packed 4:2:2 pixels, every other byte from offset
+//
+// offset is 0 for YUYV and 1 for UYVY
+inline void packed_luma(const uint8_t *yuv, size_t yuv_step,
+                        uint8_t *gray, size_t gray_step,
+                        int width, int height, int offset) {
+        for(int y = 0; y < height; ++y) {
+                const uint8_t *src = yuv + size_t(y) * yuv_step + offset;
+                uint8_t *dst = gray + size_t(y) * gray_step;
+
+                for(int x = 0; x < width; ++x)
+                        dst[x] = src[2 * x];
+        }
+}
+
+#endif
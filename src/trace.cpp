@@ -0,0 +1,124 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.hpp"
+
+// Events reserved per thread so that tracing a short run does not
+// reallocate the buffers while it is being measured
+#define TRACE_RESERVE (1 << 16)
+
+using namespace std;
+using namespace std::chrono;
+
+// Scope recorded by a thread, in ns since trace_start
+struct TraceEvent {
+        const char *name;
+        int64_t begin;
+        int64_t end;
+        int64_t frame;
+};
+
+// Events of a thread
+//
+// Only the owning thread writes to it. The buffers are kept after the
+// threads finish and are read once every thread has been joined
+struct TraceBuffer {
+        int tid;
+        const char *thread_name;
+        int64_t frame;
+        vector<TraceEvent> events;
+};
+
+atomic<bool> trace_enabled(false);
+
+static high_resolution_clock::time_point trace_origin;
+static mutex buffers_mtx;
+static vector<unique_ptr<TraceBuffer> > buffers;
+static thread_local TraceBuffer *thread_buffer = nullptr;
+
+// Buffer of the calling thread, created the first time it is needed
+static TraceBuffer &local_buffer() {
+        if (thread_buffer == nullptr) {
+                lock_guard<mutex> lock(buffers_mtx);
+
+                buffers.emplace_back(new TraceBuffer());
+                thread_buffer = buffers.back().get();
+                thread_buffer->tid = int(buffers.size());
+                thread_buffer->thread_name = nullptr;
+                thread_buffer->frame = -1;
+                thread_buffer->events.reserve(TRACE_RESERVE);
+        }
+        return *thread_buffer;
+}
+
+// Start recording the scopes
+//
+// Call it before the threads to trace are started
+void trace_start() {
+        trace_origin = high_resolution_clock::now();
+        trace_enabled = true;
+}
+
+// Nanoseconds since trace_start
+int64_t trace_now() {
+        return duration_cast<nanoseconds>(high_resolution_clock::now() - trace_origin).count();
+}
+
+// Name shown for the calling thread
+void trace_thread_name(const char *name) {
+        if (!trace_enabled.load(memory_order_relaxed)) return;
+
+        local_buffer().thread_name = name;
+}
+
+// Frame the calling thread works on, attached to its next events
+void trace_frame(int64_t index) {
+        if (!trace_enabled.load(memory_order_relaxed)) return;
+
+        local_buffer().frame = index;
+}
+
+void trace_event(const char *name, int64_t begin_ns, int64_t end_ns) {
+        TraceBuffer &buffer = local_buffer();
+        buffer.events.push_back(TraceEvent{name, begin_ns, end_ns, buffer.frame});
+}
+
+// Write every event recorded so far as Chrome trace event JSON
+//
+// Each scope is a complete ("X") event, in microseconds, with the frame
+// in its arguments. The threads get their names from metadata events.
+// Call it once the traced threads have finished.
+// Return false if the file cannot be written
+bool trace_write(const string &filename) {
+        ofstream os(filename);
+        if (!os.is_open()) return false;
+
+        lock_guard<mutex> lock(buffers_mtx);
+
+        os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        os << fixed << setprecision(3);
+
+        bool first = true;
+        for(auto &buffer : buffers) {
+                if (buffer->thread_name) {
+                        os << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+                           << buffer->tid << ", \"args\": {\"name\": \"" << buffer->thread_name << "\"}}";
+                        first = false;
+                }
+
+                for(auto &event : buffer->events) {
+                        os << (first ? "" : ",") << "\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                           << buffer->tid << ", \"ts\": " << event.begin / 1e3 << ", \"dur\": " << (event.end - event.begin) / 1e3;
+                        if (event.frame >= 0)
+                                os << ", \"args\": {\"frame\": " << event.frame << "}";
+                        os << "}";
+                        first = false;
+                }
+        }
+        os << "\n]}\n";
+        return true;
+}
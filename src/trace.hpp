@@ -0,0 +1,51 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Timeline of the pipeline written as Chrome trace event JSON, which
+// can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing
+//
+// TRACE_SCOPE("name") records the time from the macro to the end of the
+// enclosing scope, on the thread that runs it and tagged with the frame
+// set by trace_frame. The name must be a string literal.
+// Until trace_start is called a scope only reads a flag, so they can be
+// left in the hot paths
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+extern std::atomic<bool> trace_enabled;
+
+void trace_start();
+bool trace_write(const std::string &filename);
+void trace_thread_name(const char *name);
+void trace_frame(int64_t index);
+void trace_event(const char *name, int64_t begin_ns, int64_t end_ns);
+int64_t trace_now();
+
+// Event that lasts as long as the object
+class TraceScope {
+public:
+        explicit TraceScope(const char *event) : name(nullptr), begin(0) {
+                if (trace_enabled.load(std::memory_order_relaxed)) {
+                        name = event;
+                        begin = trace_now();
+                }
+        }
+
+        ~TraceScope() {
+                if (name) trace_event(name, begin, trace_now());
+        }
+
+        TraceScope(const TraceScope &) = delete;
+        TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+        const char *name;
+        int64_t begin;
+};
+
+#endif
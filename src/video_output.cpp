@@ -0,0 +1,196 @@
+#include <iostream>
+#include <csignal>
+#include <cmath>
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/imgproc.hpp>
+
+#include "video_output.hpp"
+#include "trace.hpp"
+
+using namespace std::chrono;
+
+VideoOutput::VideoOutput(const VideoOutputOptions &options, LatencyHistogram &times)
+        : options(options), times(times), pool(max<size_t>(1, options.depth)), queue(max<size_t>(1, options.depth)),
+          frames_written(0), frames_dropped(0), error(false), fifo(false), opened(false), stopping(false) {
+        if (!enabled()) return;
+
+        // A reader closing a named pipe must fail the writes, not end the
+        // program. Other outputs leave the handling of SIGPIPE as it is
+        struct stat info;
+        fifo = options.format != VideoFormat::Mjpg && stat(options.filename.c_str(), &info) == 0 && S_ISFIFO(info.st_mode);
+        if (fifo)
+                signal(SIGPIPE, SIG_IGN);
+
+        writer = std::thread(&VideoOutput::run, this);
+}
+
+VideoOutput::~VideoOutput() {
+        close();
+}
+
+// Copy the frame into a free buffer and hand it to the writer thread
+//
+// The queue holds as many frames as there are buffers, so once a buffer
+// is taken the push never waits. Until the output is open the frames
+// are dropped when there is no free buffer, whatever the policy
+void VideoOutput::write(const Mat &image, bool markers) {
+        if (!enabled() || error) return;
+        if (options.only_markers && !markers) return;
+
+        bool block = options.policy == DropPolicy::Block && opened;
+        Mat *buffer = block ? pool.acquire() : pool.try_acquire();
+        if (buffer == nullptr) {
+                frames_dropped++;
+                return;
+        }
+
+        image.copyTo(*buffer);
+        queue.push(buffer);
+}
+
+// A writer still waiting for the reader of a named pipe gives up
+void VideoOutput::close() {
+        stopping = true;
+        queue.close();
+        if (writer.joinable())
+                writer.join();
+}
+
+// Open the output and write every frame queued until it is closed
+//
+// After an error the frames are still taken from the queue, and given
+// back to the pool, so write never waits on a writer that stopped
+void VideoOutput::run() {
+        trace_thread_name("video");
+        if (open_output()) {
+                opened = true;
+        } else {
+                // Closed before a named pipe got its reader is not an error to report
+                if (!stopping)
+                        cerr << "Cannot open the video output \"" + options.filename + "\"" << endl;
+                error = true;
+        }
+
+        Mat *buffer;
+        while(queue.pop(buffer)) {
+                if (!error) {
+                        high_resolution_clock::time_point start_t = high_resolution_clock::now();
+                        if (write_frame(*buffer)) {
+                                frames_written++;
+                        } else {
+                                cerr << "Cannot write to the video output \"" + options.filename + "\"" << endl;
+                                error = true;
+                        }
+                        times.record(elapsed_ns(start_t));
+                }
+                pool.release(buffer);
+        }
+
+        video.release();
+        file.close();
+}
+
+// Open the video file, or the file or pipe of the uncompressed frames
+//
+// Y4M starts with a header giving the size and the frame rate, which
+// is written as a fraction of 1000 so that 29.97 fps is kept.
+// A named pipe is only opened once it has a reader, see wait_for_reader
+bool VideoOutput::open_output() {
+        if (options.format == VideoFormat::Mjpg)
+                return video.open(options.filename, CV_FOURCC('M','J','P','G'), options.fps, options.size);
+
+        int reader_fd = -1;
+        if (fifo && !wait_for_reader(reader_fd)) return false;
+
+        // With a reader on the pipe the open does not block
+        file.open(options.filename, ios::binary);
+        if (reader_fd >= 0) ::close(reader_fd);
+        if (!file.is_open()) return false;
+
+        if (options.format == VideoFormat::Y4m) {
+                // 4:2:0 has a chroma sample for every 2 x 2 pixels
+                if (options.size.width % 2 || options.size.height % 2) {
+                        cerr << "Y4M needs an even frame size" << endl;
+                        return false;
+                }
+                double fps = options.fps > 0 ? options.fps : 30;
+                file << "YUV4MPEG2 W" << options.size.width << " H" << options.size.height
+                     << " F" << lround(fps * 1000) << ":1000 Ip A1:1 C420jpeg\n";
+        }
+        return file.good();
+}
+
+// Wait until the named pipe has a reader, or until the output is closed
+//
+// Opening a pipe for writing blocks until it has a reader, so it is
+// opened without blocking instead, which fails with ENXIO until then.
+// fd is left open so that the reader stays counted while the pipe is
+// opened again as a stream.
+// Return false if the output was closed first or the pipe cannot be opened
+bool VideoOutput::wait_for_reader(int &fd) {
+        while(!stopping) {
+                fd = ::open(options.filename.c_str(), O_WRONLY | O_NONBLOCK);
+                if (fd >= 0) return true;
+                if (errno != ENXIO) return false;
+
+                std::this_thread::sleep_for(milliseconds(20));
+        }
+        return false;
+}
+
+// Write one BGR frame in the format of the output
+//
+// Return false if the frame cannot be written
+bool VideoOutput::write_frame(const Mat &image) {
+        TRACE_SCOPE("video_write");
+        if (image.size() != options.size) return false;
+
+        switch(options.format) {
+                case VideoFormat::Mjpg:
+                        video.write(image);
+                        return true;
+                case VideoFormat::Y4m:
+                        // The Y, U and V planes one after the other
+                        cvtColor(image, yuv, CV_BGR2YUV_I420);
+                        file << "FRAME\n";
+                        file.write(reinterpret_cast<const char *>(yuv.data), yuv.total());
+                        return file.good();
+                case VideoFormat::Raw:
+                        for(int y = 0; y < image.rows; ++y) {
+                                file.write(reinterpret_cast<const char *>(image.ptr(y)), image.cols * image.elemSize());
+                        }
+                        return file.good();
+                case VideoFormat::None:
+                        break;
+        }
+        return true;
+}
+
+// Format given by name, or guessed from the extension of the file if the
+// name is empty: .y4m is Y4M, .raw and .bgr are raw BGR, anything else MJPG.
+// Return false if the name is not known
+bool parse_video_format(const string &name, const string &filename, VideoFormat &format) {
+        string extension;
+        size_t dot = filename.find_last_of('.');
+        if (dot != string::npos) extension = filename.substr(dot);
+
+        if (name == "none" || (name == "" && filename == ""))
+                format = VideoFormat::None;
+        else if (name == "mjpg")
+                format = VideoFormat::Mjpg;
+        else if (name == "y4m" || (name == "" && extension == ".y4m"))
+                format = VideoFormat::Y4m;
+        else if (name == "raw" || (name == "" && (extension == ".raw" || extension == ".bgr")))
+                format = VideoFormat::Raw;
+        else if (name == "")
+                format = VideoFormat::Mjpg;
+        else
+                return false;
+        return true;
+}
@@ -0,0 +1,99 @@
+#ifndef _VIDEO_OUTPUT_H
+#define _VIDEO_OUTPUT_H
+
+#include <string>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "pipeline.hpp"
+#include "latency.hpp"
+
+using namespace cv;
+using namespace std;
+
+// Format of the annotated video
+enum class VideoFormat {
+        // Nothing is written
+        None,
+        // MJPG through VideoWriter, in any container it supports
+        Mjpg,
+        // Uncompressed YUV4MPEG2 in 4:2:0, which ffmpeg and most players read
+        Y4m,
+        // Bare BGR frames one after the other, with nothing around them
+        Raw
+};
+
+// Where and how the annotated video is written
+//
+// With only_markers the frames without identified markers are skipped.
+// depth is the number of frames the writer may fall behind
+struct VideoOutputOptions {
+        string filename;
+        VideoFormat format;
+        double fps;
+        Size size;
+        DropPolicy policy;
+        size_t depth;
+        bool only_markers;
+};
+
+// Writer of the annotated video on a thread of its own
+//
+// write copies the frame into a buffer of the writer and queues it, so
+// the caller is only held for the copy. The encoding and the I/O are
+// done by the writer thread. When every buffer is queued the frame is
+// dropped and counted, or with DropPolicy::Block write waits for one.
+// The file is opened by the writer thread too, and until it is open
+// write never waits: the frames are dropped instead. A named pipe without
+// a reader then does not hold the pipeline, whatever the policy, and
+// close stops waiting for the reader
+class VideoOutput {
+public:
+        VideoOutput(const VideoOutputOptions &options, LatencyHistogram &times);
+        ~VideoOutput();
+
+        bool enabled() const { return options.format != VideoFormat::None; }
+
+        // Queue a frame, markers tells if it has identified markers
+        void write(const Mat &image, bool markers);
+
+        // Write the frames still queued and stop the writer thread
+        void close();
+
+        uint64_t written() const { return frames_written.load(); }
+        uint64_t dropped() const { return frames_dropped.load(); }
+        bool failed() const { return error.load(); }
+
+private:
+        void run();
+        bool open_output();
+        bool wait_for_reader(int &fd);
+        bool write_frame(const Mat &image);
+
+        VideoOutputOptions options;
+        LatencyHistogram &times;
+        FramePool<Mat> pool;
+        BoundedQueue<Mat *> queue;
+
+        VideoWriter video;
+        ofstream file;
+        Mat yuv;
+
+        std::atomic<uint64_t> frames_written;
+        std::atomic<uint64_t> frames_dropped;
+        std::atomic<bool> error;
+        // The output is a named pipe
+        bool fifo;
+        std::atomic<bool> opened;
+        std::atomic<bool> stopping;
+        std::thread writer;
+};
+
+bool parse_video_format(const string &name, const string &filename, VideoFormat &format);
+
+#endif
@@ -0,0 +1,110 @@
+#include "work_pool.hpp"
+
+using namespace std;
+
+// Pool the calling thread works for and its index in it, -1 if none
+static thread_local const WorkStealingPool *current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+WorkStealingPool::WorkStealingPool(int workers) : queued(0), next_queue(0), stopping(false) {
+        if (workers < 1) workers = 1;
+
+        for(int w = 0; w < workers; ++w) {
+                queues.emplace_back(new WorkerQueue());
+        }
+        for(int w = 0; w < workers; ++w) {
+                threads.push_back(thread(&WorkStealingPool::work, this, w));
+        }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+        shutdown();
+}
+
+// Add a task to a queue
+//
+// It is only counted once it is in the queue, so a worker woken up for
+// it always finds it
+void WorkStealingPool::submit(Task task) {
+        const bool local = current_pool == this;
+        size_t index;
+        if (local) {
+                index = size_t(current_worker);
+        } else {
+                lock_guard<mutex> lock(mtx);
+                index = next_queue++ % queues.size();
+        }
+
+        {
+                lock_guard<mutex> lock(queues[index]->mtx);
+                (local ? queues[index]->local : queues[index]->shared).push_back(std::move(task));
+        }
+
+        {
+                lock_guard<mutex> lock(mtx);
+                queued++;
+        }
+        wake.notify_one();
+}
+
+void WorkStealingPool::shutdown() {
+        {
+                lock_guard<mutex> lock(mtx);
+                stopping = true;
+        }
+        wake.notify_all();
+
+        for(auto &t : threads) {
+                if (t.joinable()) t.join();
+        }
+}
+
+// Run tasks until the pool is shut down and every queue is empty
+void WorkStealingPool::work(int index) {
+        current_pool = this;
+        current_worker = index;
+
+        Task task;
+        for(;;) {
+                if (take(index, task)) {
+                        task(index);
+                        task = nullptr;
+                        continue;
+                }
+
+                unique_lock<mutex> lock(mtx);
+                wake.wait(lock, [this] { return stopping || queued > 0; });
+                if (stopping && queued <= 0) return;
+        }
+}
+
+// Take the newest task the worker submitted, or else the oldest task
+// given to it, or else the oldest task of another worker
+//
+// Return false if every queue is empty
+bool WorkStealingPool::take(int index, Task &task) {
+        for(size_t k = 0; k < queues.size(); ++k) {
+                size_t victim = (index + k) % queues.size();
+                WorkerQueue &queue = *queues[victim];
+
+                unique_lock<mutex> lock(queue.mtx);
+                if (k == 0 && !queue.local.empty()) {
+                        task = std::move(queue.local.back());
+                        queue.local.pop_back();
+                } else if (!queue.shared.empty()) {
+                        task = std::move(queue.shared.front());
+                        queue.shared.pop_front();
+                } else if (!queue.local.empty()) {
+                        task = std::move(queue.local.front());
+                        queue.local.pop_front();
+                } else {
+                        continue;
+                }
+                lock.unlock();
+
+                lock_guard<mutex> count_lock(mtx);
+                queued--;
+                return true;
+        }
+        return false;
+}
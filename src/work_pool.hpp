@@ -0,0 +1,61 @@
+#ifndef _WORK_POOL_H
+#define _WORK_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+// Pool of threads that run tasks, each worker with its own queue
+//
+// Tasks submitted by a worker go to its own queue, the others are
+// spread over the queues in turn. A worker runs the newest of the tasks
+// it submitted itself first, as their data is likely still in cache,
+// then the oldest of the tasks given to it, so frames of a stream run
+// in the order they were captured. Once its queue is empty it steals
+// the oldest task of another worker.
+// Tasks get the index of the worker that runs them, so they can use
+// buffers owned by that worker without locking them
+class WorkStealingPool {
+public:
+        typedef std::function<void(int)> Task;
+
+        explicit WorkStealingPool(int workers);
+        ~WorkStealingPool();
+
+        void submit(Task task);
+
+        // Run the tasks left and stop the workers
+        void shutdown();
+
+        int size() const { return int(queues.size()); }
+
+private:
+        // Tasks submitted by the worker itself, and by anyone else
+        struct WorkerQueue {
+                std::mutex mtx;
+                std::deque<Task> local;
+                std::deque<Task> shared;
+        };
+
+        void work(int index);
+        bool take(int index, Task &task);
+
+        std::vector<std::unique_ptr<WorkerQueue> > queues;
+        std::vector<std::thread> threads;
+
+        std::mutex mtx;
+        std::condition_variable wake;
+        // Tasks pushed and not taken yet. It may be -1 for a moment, when
+        // a task is taken before its submitter has counted it
+        ptrdiff_t queued;
+        size_t next_queue;
+        bool stopping;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <csignal>
+
+#include "shm_ring.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+volatile sig_atomic_t listening = 1;
+
+void stop_listening(int);
+
+// Print the markers published by Aruco -publish=<name>
+//
+// Sample consumer of the shared memory ring. It only needs shm_ring.hpp
+// and shm_ring.cpp, not OpenCV. Each frame is printed as a line with the
+// delay from its capture until it was read, then every marker. When the
+// ring is closed the name is opened again, to follow a new publisher
+//
+//   aruco_listen [name]     the name defaults to /aruco
+int main(int argc, char **argv) {
+        string name = argc > 1 ? argv[1] : "/aruco";
+
+        DetectionReader reader;
+        if (!reader.open(name)) {
+                cerr << "Cannot open the shared memory ring \"" + name + "\"" << endl;
+                return -1;
+        }
+        signal(SIGINT, stop_listening);
+        signal(SIGTERM, stop_listening);
+
+        DetectionRecord record;
+        while(listening) {
+                if (!reader.next(record)) {
+                        if (reader.closed()) {
+                                reader.close();
+                                if (reader.open(name)) cout << "Following a new ring" << endl;
+                        }
+                        this_thread::sleep_for(microseconds(200));
+                        continue;
+                }
+
+                int64_t now_ns = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+                cout << "frame " << record.frame << " delay " << (now_ns - record.timestamp_ns) / 1e3 << " us, "
+                     << record.total << " markers" << endl;
+
+                for(uint32_t m = 0; m < record.count; ++m) {
+                        const MarkerRecord &marker = record.markers[m];
+                        cout << "  id " << marker.id << " center ("
+                             << (marker.corners[0][0] + marker.corners[2][0]) / 2 << ", "
+                             << (marker.corners[0][1] + marker.corners[2][1]) / 2 << ") tvec ("
+                             << marker.tvec[0] << ", " << marker.tvec[1] << ", " << marker.tvec[2] << ")" << endl;
+                }
+        }
+
+        cout << "Records lost: " << reader.lost() << endl;
+        return 0;
+}
+
+void stop_listening(int) {
+        listening = 0;
+}
@@ -0,0 +1,289 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "detection_log.hpp"
+
+using namespace std;
+
+void print_info(const DetectionLog &log);
+void print_frames(const DetectionLog &log, int id);
+void print_track(const DetectionLog &log, int id, int64_t from_ns, int64_t to_ns);
+int check_log(const string &filename);
+
+// Answer queries on a detection log written by Aruco -log=<file>
+//
+//   aruco_query <log> info                 chunks of the log
+//   aruco_query <log> frames <id>          ranges of frames where the marker was seen
+//   aruco_query <log> track <id> [t1 t2]   pose of the marker, between t1 and t2
+//                                          seconds since the epoch if given
+//   aruco_query <new file> check           write a log to the file and check that it
+//                                          reads back, also after a crash cut it
+//
+// The log is mapped and only the columns a query needs are decoded.
+// Chunks whose ranges of time or ids rule them out are not read at all
+int main(int argc, char **argv) {
+        if (argc < 3) {
+                cerr << "Usage: aruco_query <log> info | frames <id> | track <id> [t1 t2] | check" << endl;
+                return -1;
+        }
+
+        if (string(argv[2]) == "check") return check_log(argv[1]);
+
+        DetectionLog log;
+        if (!log.open(argv[1])) {
+                cerr << "Cannot read the detection log \"" << argv[1] << "\"" << endl;
+                return -1;
+        }
+
+        string query = argv[2];
+        if (query == "info") {
+                print_info(log);
+        } else if (query == "frames" && argc == 4) {
+                print_frames(log, atoi(argv[3]));
+        } else if (query == "track" && (argc == 4 || argc == 6)) {
+                int64_t from_ns = argc == 6 ? int64_t(atof(argv[4]) * 1e9) : INT64_MIN;
+                int64_t to_ns = argc == 6 ? int64_t(atof(argv[5]) * 1e9) : INT64_MAX;
+                print_track(log, atoi(argv[3]), from_ns, to_ns);
+        } else {
+                cerr << "Unknown query" << endl;
+                return -1;
+        }
+        return 0;
+}
+
+// Print the ranges of every chunk, from the index alone
+void print_info(const DetectionLog &log) {
+        uint64_t detections = 0;
+
+        for(auto &chunk : log.chunks()) {
+                const LogChunkHeader &h = chunk.header;
+                cout << "chunk at " << chunk.offset << ": " << h.rows << " detections, frames "
+                     << h.first_frame << "-" << h.last_frame << ", ids " << h.min_id << "-" << h.max_id
+                     << ", " << h.payload_size << " bytes" << endl;
+                detections += h.rows;
+        }
+        cout << log.chunks().size() << " chunks, " << detections << " detections" << endl;
+}
+
+// Print the frames where a marker was seen, consecutive frames as a range
+//
+// Only the id column is decoded, and the frame column of the chunks
+// where the marker is
+void print_frames(const DetectionLog &log, int id) {
+        vector<int32_t> ids;
+        vector<uint64_t> frames;
+        bool open = false;
+        uint64_t first = 0, last = 0;
+
+        for(auto &chunk : log.chunks()) {
+                if (!chunk_contains_id(chunk.header, id)) continue;
+
+                log.read_ids(chunk, ids);
+                bool found = false;
+                for(int32_t i : ids) found = found || i == id;
+                if (!found) continue;
+
+                log.read_frames(chunk, frames);
+                for(size_t r = 0; r < ids.size(); ++r) {
+                        if (ids[r] != id) continue;
+
+                        if (open && frames[r] <= last + 1) {
+                                last = max(last, frames[r]);
+                                continue;
+                        }
+                        if (open) cout << first << "-" << last << endl;
+                        first = last = frames[r];
+                        open = true;
+                }
+        }
+        if (open) cout << first << "-" << last << endl;
+}
+
+// Print the pose of a marker in every frame it was seen in a time range
+//
+// frame, timestamp in seconds, tvec and rvec
+void print_track(const DetectionLog &log, int id, int64_t from_ns, int64_t to_ns) {
+        vector<int32_t> ids;
+        vector<int64_t> timestamps;
+        vector<uint64_t> frames;
+        vector<double> rvecs, tvecs;
+
+        cout << fixed;
+        for(auto &chunk : log.chunks()) {
+                const LogChunkHeader &h = chunk.header;
+                if (h.last_timestamp < from_ns || h.first_timestamp > to_ns) continue;
+                if (!chunk_contains_id(h, id)) continue;
+
+                log.read_ids(chunk, ids);
+                log.read_timestamps(chunk, timestamps);
+
+                bool found = false;
+                for(size_t r = 0; r < ids.size(); ++r) {
+                        found = found || (ids[r] == id && timestamps[r] >= from_ns && timestamps[r] <= to_ns);
+                }
+                if (!found) continue;
+
+                log.read_frames(chunk, frames);
+                log.read_vectors(chunk, LOG_RVEC, rvecs);
+                log.read_vectors(chunk, LOG_TVEC, tvecs);
+
+                for(size_t r = 0; r < ids.size(); ++r) {
+                        if (ids[r] != id || timestamps[r] < from_ns || timestamps[r] > to_ns) continue;
+
+                        cout << frames[r] << " " << setprecision(6) << timestamps[r] / 1e9
+                             << " tvec " << tvecs[3 * r] << " " << tvecs[3 * r + 1] << " " << tvecs[3 * r + 2]
+                             << " rvec " << rvecs[3 * r] << " " << rvecs[3 * r + 1] << " " << rvecs[3 * r + 2] << endl;
+                }
+        }
+}
+
+// Detection number n of the log written by check_log
+//
+// Frames skip some numbers, timestamps sometimes go back and ids and
+// distances can be negative, so every branch of the encoding is used
+MarkerRecord check_marker(uint64_t n, uint64_t &frame, int64_t &timestamp_ns) {
+        frame = 1000 + n + (n % 7 == 0 ? 100000 : 0) * (n / 7);
+        timestamp_ns = 1500000000000000000ll + int64_t(n) * 33333333 - (n % 5 == 0 ? 50000000 : 0);
+
+        MarkerRecord marker;
+        marker.id = int32_t(n % 97) - 3;
+        marker.distance = n % 11 == 0 ? INT32_MIN + int32_t(n % 13) : int32_t(n % 4);
+        for(int k = 0; k < 8; ++k) marker.corners[k / 2][k % 2] = float(n) * 0.5f + k;
+        for(int k = 0; k < 3; ++k) {
+                marker.rvec[k] = 0.001 * double(n) - k;
+                marker.tvec[k] = -1e6 * double(n) + k;
+        }
+        return marker;
+}
+
+// Whether a log holds exactly the first rows detections of check_marker
+bool check_rows(const string &filename, uint64_t rows) {
+        DetectionLog log;
+        if (!log.open(filename)) return false;
+
+        vector<uint64_t> frames;
+        vector<int64_t> timestamps;
+        vector<int32_t> ids, distances;
+        vector<float> corners;
+        vector<double> rvecs, tvecs;
+
+        uint64_t n = 0;
+        for(auto &chunk : log.chunks()) {
+                log.read_frames(chunk, frames);
+                log.read_timestamps(chunk, timestamps);
+                log.read_ids(chunk, ids);
+                log.read_distances(chunk, distances);
+                log.read_corners(chunk, corners);
+                log.read_vectors(chunk, LOG_RVEC, rvecs);
+                log.read_vectors(chunk, LOG_TVEC, tvecs);
+
+                for(size_t r = 0; r < frames.size(); ++r, ++n) {
+                        uint64_t frame;
+                        int64_t timestamp_ns;
+                        MarkerRecord marker = check_marker(n, frame, timestamp_ns);
+                        if (frames[r] != frame || timestamps[r] != timestamp_ns || ids[r] != marker.id
+                                || distances[r] != marker.distance
+                                || memcmp(&corners[8 * r], marker.corners, sizeof(marker.corners)) != 0
+                                || memcmp(&rvecs[3 * r], marker.rvec, sizeof(marker.rvec)) != 0
+                                || memcmp(&tvecs[3 * r], marker.tvec, sizeof(marker.tvec)) != 0)
+                                return false;
+                }
+        }
+        return n == rows;
+}
+
+// Write a log and check that it reads back as it was written
+//
+// The variable length integers are checked on their limits first. The
+// log is then read through its index, cut in the middle of its last
+// chunk as a crash would leave it, appended to and read again, and read
+// with an index whose entries point outside the file
+int check_log(const string &filename) {
+        struct stat info;
+        if (stat(filename.c_str(), &info) == 0) {
+                cerr << "The file \"" << filename << "\" exists, check writes a new log" << endl;
+                return -1;
+        }
+
+        const uint64_t values[] = {0, 1, 127, 128, 16383, 16384, UINT32_MAX, uint64_t(INT64_MAX), UINT64_MAX};
+        const int64_t signed_values[] = {0, -1, 1, -64, 64, INT32_MIN, INT32_MAX, INT64_MIN, INT64_MAX};
+        vector<uint8_t> bytes;
+        for(uint64_t v : values) put_varint(bytes, v);
+        for(int64_t v : signed_values) put_varint(bytes, zigzag(v));
+
+        bool ok = true;
+        const uint8_t *p = bytes.data(), *bytes_end = bytes.data() + bytes.size();
+        for(uint64_t v : values) ok = ok && get_varint(p, bytes_end) == v;
+        for(int64_t v : signed_values) ok = ok && unzigzag(get_varint(p, bytes_end)) == v;
+        ok = ok && p == bytes_end && get_varint(p, bytes_end) == 0;
+        if (!ok) {
+                cerr << "Variable length integers do not read back" << endl;
+                return -1;
+        }
+
+        const uint64_t rows = 2 * LOG_CHUNK_ROWS + 100, more = 300;
+        uint64_t frame;
+        int64_t timestamp_ns;
+
+        DetectionLogWriter writer;
+        if (!writer.open(filename)) {
+                cerr << "Cannot write the detection log \"" << filename << "\"" << endl;
+                return -1;
+        }
+        for(uint64_t n = 0; n < rows; ++n) {
+                MarkerRecord marker = check_marker(n, frame, timestamp_ns);
+                writer.append(frame, timestamp_ns, marker);
+        }
+        ok = writer.close() && check_rows(filename, rows);
+        if (!ok) cerr << "The log does not read back through its index" << endl;
+
+        // Cut the last chunk, as if the writer died while writing it
+        uint64_t complete = 0;
+        {
+                DetectionLog log;
+                ok = ok && log.open(filename) && log.chunks().size() == 3;
+                if (ok) {
+                        const LogChunk &last = log.chunks().back();
+                        complete = rows - last.header.rows;
+                        ok = truncate(filename.c_str(), last.offset + sizeof(LogChunkHeader) + last.header.payload_size / 2) == 0;
+                }
+        }
+        ok = ok && check_rows(filename, complete);
+        if (!ok) cerr << "The log cut by a crash does not read back" << endl;
+
+        // Append after the cut, which drops the partial chunk
+        ok = ok && writer.open(filename);
+        for(uint64_t n = complete; ok && n < complete + more; ++n) {
+                MarkerRecord marker = check_marker(n, frame, timestamp_ns);
+                writer.append(frame, timestamp_ns, marker);
+        }
+        ok = ok && writer.close() && check_rows(filename, complete + more);
+        if (!ok) cerr << "The log appended to after a crash does not read back" << endl;
+
+        // Point an index entry past the end of the file, the chunks are then scanned
+        if (ok) {
+                DetectionLog log;
+                ok = log.open(filename) && stat(filename.c_str(), &info) == 0;
+                uint64_t entry = log.data_end() + offsetof(LogChunk, offset);
+                FILE *file = ok ? fopen(filename.c_str(), "r+b") : nullptr;
+                uint64_t bad_offset = uint64_t(info.st_size) * 2;
+                ok = file != nullptr && fseek(file, long(entry), SEEK_SET) == 0
+                        && fwrite(&bad_offset, sizeof(bad_offset), 1, file) == 1;
+                if (file != nullptr) fclose(file);
+        }
+        ok = ok && check_rows(filename, complete + more);
+        if (!ok) cerr << "The log with a damaged index does not read back" << endl;
+
+        unlink(filename.c_str());
+        if (ok) cout << "The detection log reads back" << endl;
+        return ok ? 0 : -1;
+}
@@ -0,0 +1,255 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <iomanip>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/opencv_modules.hpp>
+#ifdef HAVE_OPENCV_ARUCO
+#include <opencv2/aruco.hpp>
+#endif
+
+#include "decoding_table.hpp"
+
+using namespace cv;
+using namespace std;
+
+bool read_marker_images(const string &dir, int bits, vector<uint64_t> &codes);
+bool read_predefined(const string &name, int bits, vector<uint64_t> &codes);
+int image_id(const string &filename);
+bool is_header(const string &filename);
+void write_header(ostream &os, const string &source, int bits, const vector<uint64_t> &codes);
+
+// Generate the dictionary of markers compiled into the detector, or a
+// dictionary file loaded by the detector at startup
+//
+// The source is either a directory of marker images, named so that
+// the number before the extension is the id of the marker, or the name
+// of a predefined ArUco dictionary such as DICT_4X4_1000, which needs
+// the aruco module of opencv_contrib.
+// Each marker is stored once, as the bits of its inner cells with no
+// rotation. The detector derives the rotations when it reads a marker.
+// An out file ending in .hpp or .h is written as a header, any other as
+// a dictionary file. The file may also hold the lookup table for a
+// tolerance, which then costs nothing to load
+int main(int argc, char **argv) {
+
+        const String keys =
+        "{help h usage ? |          | Print this message }"
+        "{source         |<none>    | Directory of marker images or name of a predefined dictionary }"
+        "{bits           |4         | Cells per side of the code of the markers, without the border. Must match a predefined dictionary }"
+        "{out            |<none>    | Header (.hpp or .h) or dictionary file to write }"
+        "{table          |1         | Tolerance of the lookup table stored in a dictionary file (-1 = no table) }";
+
+        CommandLineParser cmdParser(argc, argv, keys);
+
+        if (cmdParser.has("help"))
+        {
+                cmdParser.printMessage();
+                return 0;
+        }
+
+        String source = cmdParser.get<String>("source");
+        int bits = cmdParser.get<int>("bits");
+        vector<uint64_t> codes;
+
+        bool read = source.compare(0, 5, "DICT_") == 0
+                ? read_predefined(source, bits, codes)
+                : read_marker_images(source, bits, codes);
+        if (!read) return -1;
+
+        String out_file = cmdParser.get<String>("out");
+        if (!is_header(out_file)) {
+                if (!write_dictionary(out_file, codes.data(), int(codes.size()), bits, cmdParser.get<int>("table"))) {
+                        cerr << "Cannot write \"" + out_file + "\"" << endl;
+                        return -1;
+                }
+                return 0;
+        }
+
+        ofstream out(out_file);
+        if (!out.is_open()) {
+                cerr << "Cannot open \"" + out_file + "\"" << endl;
+                return -1;
+        }
+        write_header(out, source, bits, codes);
+        return 0;
+}
+
+// Read the code of every marker image of a directory
+//
+// The images are the marker with its black border and nothing around
+// it. Transparent pixels are taken as white. Each cell is the mean of
+// its pixels, so the images may be of any size.
+// The ids must go from 0 to the number of images minus 1
+bool read_marker_images(const string &dir, int bits, vector<uint64_t> &codes) {
+        if (bits < 1 || bits > MAX_MARKER_BITS) {
+                cerr << "The markers must have between 1 and " << MAX_MARKER_BITS << " bits per side" << endl;
+                return false;
+        }
+
+        vector<String> files;
+        glob(dir + "/*.png", files, false);
+        if (files.empty()) {
+                cerr << "No marker images in \"" + dir + "\"" << endl;
+                return false;
+        }
+
+        const int cells = bits + 2;
+        codes.assign(files.size(), 0);
+        vector<bool> seen(files.size(), false);
+
+        for(auto &file : files) {
+                int id = image_id(file);
+                if (id < 0 || id >= int(files.size()) || seen[id]) {
+                        cerr << "\"" + file + "\" does not have a valid id, the ids must go from 0 to "
+                             << files.size() - 1 << endl;
+                        return false;
+                }
+                seen[id] = true;
+
+                Mat image = imread(file, IMREAD_UNCHANGED);
+                if (image.empty()) {
+                        cerr << "Cannot read \"" + file + "\"" << endl;
+                        return false;
+                }
+
+                Mat gray;
+                if (image.channels() == 4) {
+                        cvtColor(image, gray, CV_BGRA2GRAY);
+                        for(int y = 0; y < image.rows; ++y) {
+                                for(int x = 0; x < image.cols; ++x) {
+                                        int alpha = image.at<Vec4b>(y, x)[3];
+                                        uint8_t &g = gray.at<uint8_t>(y, x);
+                                        g = uint8_t((g * alpha + 255 * (255 - alpha)) / 255);
+                                }
+                        }
+                } else if (image.channels() == 3) {
+                        cvtColor(image, gray, CV_BGR2GRAY);
+                } else {
+                        gray = image;
+                }
+
+                Mat mean;
+                resize(gray, mean, Size(cells, cells), 0, 0, INTER_AREA);
+
+                uint64_t code = 0;
+                for(int c = 0; c < cells; ++c) {
+                        for(int r = 0; r < cells; ++r) {
+                                bool white = mean.at<uint8_t>(c, r) > 127;
+                                bool border = c == 0 || r == 0 || c == cells - 1 || r == cells - 1;
+
+                                if (border && white) {
+                                        cerr << "\"" + file + "\" is not a marker with " << bits
+                                             << " bits per side, its border is not black" << endl;
+                                        return false;
+                                }
+                                if (!border && white)
+                                        code |= uint64_t(1) << ((c - 1) * bits + (r - 1));
+                        }
+                }
+                codes[id] = code;
+        }
+        return true;
+}
+
+// Read the codes of a predefined ArUco dictionary, DICT_<bits>X<bits>_<markers>
+bool read_predefined(const string &name, int bits, vector<uint64_t> &codes) {
+#ifdef HAVE_OPENCV_ARUCO
+        int side = 0, markers = 0;
+        if (sscanf(name.c_str(), "DICT_%dX%*d_%d", &side, &markers) != 2 || side < 4 || side > MAX_MARKER_BITS) {
+                cerr << "Unknown dictionary \"" + name + "\"" << endl;
+                return false;
+        }
+
+        // Each side comes with 50, 100, 250 and 1000 markers
+        const int sizes[] = {50, 100, 250, 1000};
+        int size_index = int(find(begin(sizes), end(sizes), markers) - begin(sizes));
+        if (size_index == 4) {
+                cerr << "Unknown dictionary \"" + name + "\"" << endl;
+                return false;
+        }
+
+        Ptr<aruco::Dictionary> dictionary = aruco::getPredefinedDictionary((side - 4) * 4 + size_index);
+
+        // The detector reads markers of the size given, which must be
+        // the one of the dictionary
+        if (dictionary->markerSize != bits) {
+                cerr << "\"" + name + "\" has " << dictionary->markerSize << " bits per side, not " << bits
+                     << ", set -bits to match" << endl;
+                return false;
+        }
+
+        for(int m = 0; m < dictionary->bytesList.rows; ++m) {
+                Mat marker = aruco::Dictionary::getBitsFromByteList(dictionary->bytesList.rowRange(m, m + 1), bits);
+
+                uint64_t code = 0;
+                for(int c = 0; c < bits; ++c) {
+                        for(int r = 0; r < bits; ++r) {
+                                if (marker.at<uint8_t>(c, r))
+                                        code |= uint64_t(1) << (c * bits + r);
+                        }
+                }
+                codes.push_back(code);
+        }
+        return true;
+#else
+        (void) bits;
+        (void) codes;
+        cerr << "Predefined dictionaries such as \"" + name + "\" need the aruco module of opencv_contrib" << endl;
+        return false;
+#endif
+}
+
+// Id of a marker image, the number before its extension
+//
+// Return -1 if there is no number
+int image_id(const string &filename) {
+        size_t end = filename.find_last_of('.');
+        if (end == string::npos) end = filename.size();
+
+        size_t begin = end;
+        while (begin > 0 && isdigit((unsigned char) filename[begin - 1])) begin--;
+        if (begin == end) return -1;
+
+        return atoi(filename.substr(begin, end - begin).c_str());
+}
+
+// Whether a file name has the extension of a header
+bool is_header(const string &filename) {
+        size_t dot = filename.find_last_of('.');
+        if (dot == string::npos) return false;
+
+        string extension = filename.substr(dot);
+        return extension == ".hpp" || extension == ".h";
+}
+
+// Write the dictionary as a header with a constexpr table
+void write_header(ostream &os, const string &source, int bits, const vector<uint64_t> &codes) {
+        os << "// Generated by gen_dictionary from " << source << ", do not edit\n"
+           << "#ifndef _DICTIONARY_H\n"
+           << "#define _DICTIONARY_H\n\n"
+           << "#include <cstdint>\n\n"
+           << "// Cells per side of the code of a marker, without the black border\n"
+           << "#define DICT_MARKER_BITS " << bits << "\n"
+           << "// Number of markers of the dictionary\n"
+           << "#define DICT_NUM_MARKERS " << codes.size() << "\n\n"
+           << "// Code of each marker with no rotation. The cell at row c and\n"
+           << "// column r is bit c * DICT_MARKER_BITS + r, white cells are 1\n"
+           << "constexpr uint64_t DICT_CODES[DICT_NUM_MARKERS] = {";
+
+        for(size_t m = 0; m < codes.size(); ++m) {
+                os << (m % 4 ? " " : "\n        ") << "0x" << hex << setw((bits * bits + 3) / 4) << setfill('0')
+                   << codes[m] << dec << (m + 1 < codes.size() ? "," : "");
+        }
+        os << "\n};\n\n#endif\n";
+}